@@ -0,0 +1,109 @@
+
+#include "AudioDecoder.h"
+
+#include <cstring>
+#include <vector>
+extern "C" {
+    #include <libavutil/opt.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswresample/swresample.h>
+}
+#include "sampleConversion.h"
+
+AudioDecoder * AudioDecoder::open(const AVCodecParameters *codecpar, int outputSampleFormat, int outputChannels) {
+    AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+    int64_t outputLayout = channelLayout(outputChannels);
+    if (!codec || !outputLayout || av_sample_fmt_is_planar((AVSampleFormat) outputSampleFormat))
+        return NULL;
+    AudioDecoder *decoder = new AudioDecoder;
+    decoder->outputSampleFormat = outputSampleFormat;
+    decoder->outputChannels = outputChannels;
+    decoder->outputLayout = outputLayout;
+    if ((decoder->cc = avcodec_alloc_context3(codec))) {
+        AVCodecContext *cc = decoder->cc;
+        if (avcodec_parameters_to_context(cc, codecpar) >= 0) {
+            AVDictionary *options = NULL;
+            if (avcodec_open2(cc, codec, &options) >= 0) {
+                // The resampler is only set up in advance if the decoder's own format cannot be used directly
+                if ((decoder->isDirect(cc->sample_fmt, cc->channels, cc->channel_layout) || decoder->initResampler()) && (decoder->frame = av_frame_alloc()))
+                    return decoder;
+            }
+        }
+    }
+    delete decoder;
+    return NULL;
+}
+
+int64_t AudioDecoder::channelLayout(int channels) {
+    switch (channels) {
+        case 1:
+            return AV_CH_LAYOUT_MONO;
+        case 2:
+            return AV_CH_LAYOUT_STEREO;
+        case 6:
+            return AV_CH_LAYOUT_5POINT1;
+    }
+    return 0;
+}
+
+AudioDecoder::AudioDecoder() : cc(NULL), sc(NULL), frame(NULL), outputSampleFormat(AV_SAMPLE_FMT_NONE), outputChannels(0), outputLayout(0) { }
+
+AudioDecoder::~AudioDecoder() {
+    if (frame)
+        av_frame_free(&frame);
+    if (sc)
+        swr_free(&sc);
+    if (cc) {
+        avcodec_close(cc);
+        avcodec_free_context(&cc);
+    }
+}
+
+bool AudioDecoder::receiveFrames(const std::function<bool(AVFrame *)> &callback) {
+    while (!avcodec_receive_frame(cc, frame)) {
+        if (frame->nb_samples > 0 && !callback(frame))
+            return false;
+    }
+    return true;
+}
+
+bool AudioDecoder::isDirect(int sampleFormat, int channels, uint64_t channelLayout) const {
+    return channels == outputChannels && av_get_packed_sample_fmt((AVSampleFormat) sampleFormat) == outputSampleFormat && (!channelLayout || channelLayout == (uint64_t) outputLayout);
+}
+
+bool AudioDecoder::initResampler() {
+    if (!(sc = swr_alloc()))
+        return false;
+    av_opt_set_int(sc, "in_channel_layout", cc->channel_layout ? cc->channel_layout : av_get_default_channel_layout(cc->channels), 0);
+    av_opt_set_int(sc, "in_sample_rate", cc->sample_rate, 0);
+    av_opt_set_int(sc, "in_sample_fmt", cc->sample_fmt, 0);
+    av_opt_set_int(sc, "out_channel_layout", outputLayout, 0);
+    av_opt_set_int(sc, "out_sample_rate", cc->sample_rate, 0);
+    av_opt_set_int(sc, "out_sample_fmt", outputSampleFormat, 0);
+    if (swr_init(sc) >= 0)
+        return true;
+    swr_free(&sc);
+    return false;
+}
+
+bool AudioDecoder::convert(unsigned char *output, const AVFrame *frame, int offset, int samples) {
+    AVSampleFormat frameFormat = (AVSampleFormat) frame->format;
+    bool planar = av_sample_fmt_is_planar(frameFormat) != 0;
+    int planes = planar ? frame->channels : 1;
+    size_t offsetSize = (size_t) offset*av_get_bytes_per_sample(frameFormat)*(planar ? 1 : frame->channels);
+    std::vector<const uint8_t *> input(planes);
+    for (int i = 0; i < planes; ++i)
+        input[i] = frame->extended_data[i]+offsetSize;
+    // When the decoder already produces the output format, the samples are copied as they are, or just interleaved if they are planar
+    if (isDirect(frameFormat, frame->channels, frame->channel_layout)) {
+        if (planar)
+            interleaveSamples(output, &input[0], outputChannels, av_get_bytes_per_sample((AVSampleFormat) outputSampleFormat), samples);
+        else
+            memcpy(output, input[0], (size_t) samples*outputChannels*av_get_bytes_per_sample((AVSampleFormat) outputSampleFormat));
+        return true;
+    }
+    if (!sc && !initResampler())
+        return false;
+    unsigned char *target[8] = { output };
+    return swr_convert(sc, target, samples, &input[0], samples) >= 0;
+}
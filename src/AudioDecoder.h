@@ -0,0 +1,41 @@
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+struct AVCodecParameters;
+struct AVCodecContext;
+struct AVFrame;
+struct SwrContext;
+
+/// Audio decoder of a single stream with a converter to interleaved samples of the output format
+struct AudioDecoder {
+    AVCodecContext *cc;
+    SwrContext *sc;
+    AVFrame *frame;
+    // AVSampleFormat of the output, which is always packed
+    int outputSampleFormat;
+    int outputChannels;
+    int64_t outputLayout;
+
+    /// Opens a decoder of the stream with the given output sample format (AVSampleFormat) and number of channels, which may be 1 (mono), 2 (stereo), or 6 (5.1)
+    static AudioDecoder * open(const AVCodecParameters *codecpar, int outputSampleFormat, int outputChannels);
+    /// Returns the channel layout of the supported number of channels, or zero if unsupported
+    static int64_t channelLayout(int channels);
+
+    AudioDecoder(const AudioDecoder &) = delete;
+    ~AudioDecoder();
+    AudioDecoder & operator=(const AudioDecoder &) = delete;
+    /// Passes all frames available from the decoder to the callback until it returns false
+    bool receiveFrames(const std::function<bool(AVFrame *)> &callback);
+    /// Converts samples of frame starting at offset to the output format. Returns false if the resampler cannot be set up.
+    bool convert(unsigned char *output, const AVFrame *frame, int offset, int samples);
+
+private:
+    AudioDecoder();
+    /// Returns true if samples of the format only need to be copied or interleaved, without swresample
+    bool isDirect(int sampleFormat, int channels, uint64_t channelLayout) const;
+    bool initResampler();
+
+};
@@ -1,45 +1,97 @@
 
 #include "FfmpegExtension.h"
 
+#include <functional>
+
 extern "C" {
     #include <libavformat/avformat.h>
 }
 
-FfmpegExtension::FfmpegExtension() { }
+#define INITIAL_BUCKET_COUNT 64
+
+FfmpegExtension::FfmpegExtension() : workerPool(NULL), sampleCacheWriter(NULL), buckets(INITIAL_BUCKET_COUNT, NULL), objectCount(0) { }
 
 FfmpegExtension::~FfmpegExtension() {
-    for (std::map<LogicalObject *, int>::iterator entry = objectRefs.begin(); entry != objectRefs.end(); ++entry)
-        if (entry->second > 0)
-            delete entry->first;
+    for (std::vector<LogicalObject *>::iterator bucket = buckets.begin(); bucket != buckets.end(); ++bucket) {
+        while (LogicalObject *object = *bucket) {
+            *bucket = object->nextInBucket;
+            delete object;
+        }
+    }
+    delete sampleCacheWriter;
+    delete workerPool;
 }
 
 void FfmpegExtension::refObject(LogicalObject *object) {
     if (!object)
         return;
-    int &refCount = objectRefs[object];
-    if (refCount == 0)
-        objectLookup[object->getName()] = object;
-    ++refCount;
+    if (object->refCount++ == 0) {
+        if (objectCount >= buckets.size())
+            rehash(2*buckets.size());
+        object->nameHash = std::hash<std::string>()(object->getName());
+        LogicalObject *&bucket = buckets[object->nameHash%buckets.size()];
+        object->nextInBucket = bucket;
+        bucket = object;
+        ++objectCount;
+    }
 }
 
 void FfmpegExtension::unrefObject(LogicalObject *object) {
     if (!object)
         return;
-    int &refCount = objectRefs[object];
-    --refCount;
-    if (refCount == 0) {
-        std::map<std::string, LogicalObject *>::iterator entry = objectLookup.find(object->getName());
-        if (entry != objectLookup.end() && entry->second == object)
-            objectLookup.erase(entry);
+    if (--object->refCount == 0) {
+        for (LogicalObject **link = &buckets[object->nameHash%buckets.size()]; *link; link = &(*link)->nextInBucket) {
+            if (*link == object) {
+                *link = object->nextInBucket;
+                --objectCount;
+                break;
+            }
+        }
         delete object;
     }
 }
 
 LogicalObject * FfmpegExtension::findObject(const std::string &name) const {
     if (!name.empty()) {
-        std::map<std::string, LogicalObject *>::const_iterator entry = objectLookup.find(name);
-        if (entry != objectLookup.end())
-            return entry->second;
+        size_t hash = std::hash<std::string>()(name);
+        for (LogicalObject *object = buckets[hash%buckets.size()]; object; object = object->nextInBucket) {
+            if (object->nameHash == hash && object->getName() == name)
+                return object;
+        }
     }
     return NULL;
 }
+
+SharedVideoDecoder::Pool * FfmpegExtension::getVideoDecoderPool() {
+    return &videoDecoderPool;
+}
+
+WorkerPool * FfmpegExtension::getWorkerPool() {
+    std::lock_guard<std::mutex> lock(lazyMemberMutex);
+    if (!workerPool)
+        workerPool = new WorkerPool;
+    return workerPool;
+}
+
+SampleCache::Writer * FfmpegExtension::getSampleCacheWriter() {
+    std::lock_guard<std::mutex> lock(lazyMemberMutex);
+    if (!sampleCacheWriter)
+        sampleCacheWriter = new SampleCache::Writer;
+    return sampleCacheWriter;
+}
+
+void FfmpegExtension::rehash(size_t bucketCount) {
+    std::vector<LogicalObject *> newBuckets(bucketCount, NULL);
+    // Each chain is moved in reverse so that objects of the same name stay ordered from the most recently registered
+    for (std::vector<LogicalObject *>::iterator bucket = buckets.begin(); bucket != buckets.end(); ++bucket) {
+        std::vector<LogicalObject *> chain;
+        for (LogicalObject *object = *bucket; object; object = object->nextInBucket)
+            chain.push_back(object);
+        for (std::vector<LogicalObject *>::reverse_iterator it = chain.rbegin(); it != chain.rend(); ++it) {
+            LogicalObject *&newBucket = newBuckets[(*it)->nameHash%bucketCount];
+            (*it)->nextInBucket = newBucket;
+            newBucket = *it;
+        }
+    }
+    buckets.swap(newBuckets);
+}
@@ -13,8 +13,12 @@
 
 #include <cstdlib>
 #include <string>
-#include <map>
+#include <vector>
+#include <mutex>
 #include "LogicalObject.h"
+#include "SharedVideoDecoder.h"
+#include "WorkerPool.h"
+#include "SampleCache.h"
 
 #define EXTENSION_NAME "ffmpeg"
 #define EXTENSION_VERSION 140
@@ -25,6 +29,9 @@
 #define INITIALIZER_MP4_EXPORT_ID 1
 #define INITIALIZER_MP4_EXPORT_NAME "mp4"
 
+#define ERROR_THREADING_KEYWORD "The decoder threading mode may be auto, single, frame or slice"
+#define ERROR_THREAD_COUNT_POSITIVE "The number of decoder threads must be a positive integer"
+#define ERROR_SCRUB_KEYWORD "Only the scrub keyword may follow the decoder threading mode"
 #define ERROR_EXPORT_SOURCE_TYPE "Only animation objects may be exported as video files"
 #define ERROR_FORMAT_KEYWORD "The supported video compression formats are h264 and hevc"
 #define ERROR_COLOR_KEYWORD "Color format (yuv420 or yuv444), encoder settings or video framerate expected"
@@ -42,9 +49,22 @@ public:
     void refObject(LogicalObject *object);
     void unrefObject(LogicalObject *object);
     LogicalObject * findObject(const std::string &name) const;
+    SharedVideoDecoder::Pool * getVideoDecoderPool();
+    /// Worker threads shared by sound decoding, created on first use
+    WorkerPool * getWorkerPool();
+    /// Background writer of the sample cache, created on first use
+    SampleCache::Writer * getSampleCacheWriter();
 
 private:
-    std::map<LogicalObject *, int> objectRefs;
-    std::map<std::string, LogicalObject *> objectLookup;
+    SharedVideoDecoder::Pool videoDecoderPool;
+    WorkerPool *workerPool;
+    SampleCache::Writer *sampleCacheWriter;
+    // Guards the creation of members created on first use
+    std::mutex lazyMemberMutex;
+    // Hash table of referenced objects by name, chained through the objects themselves, most recently registered first
+    std::vector<LogicalObject *> buckets;
+    size_t objectCount;
+
+    void rehash(size_t bucketCount);
 
 };
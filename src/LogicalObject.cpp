@@ -1,7 +1,7 @@
 
 #include "LogicalObject.h"
 
-LogicalObject::LogicalObject(const std::string &name) : name(name) { }
+LogicalObject::LogicalObject(const std::string &name) : name(name), refCount(0), nameHash(0), nextInBucket(NULL) { }
 
 const std::string & LogicalObject::getName() const {
     return name;
@@ -45,16 +45,24 @@ bool LogicalObject::offerSource(int sourceId) const {
     return false;
 }
 
+void * LogicalObject::getSourcePixelBuffer(int sourceId, int width, int height) {
+    return NULL;
+}
+
 void LogicalObject::setSourcePixels(int sourceId, const void *pixels, int width, int height) { }
 
+void LogicalObject::releaseSourcePixelBuffer(int sourceId, void *buffer) { }
+
 bool LogicalObject::pixelsReady() const {
     return false;
 }
 
-const void * LogicalObject::fetchPixels(float time, float deltaTime, bool realTime, int width, int height) {
+const void * LogicalObject::fetchPixels(float time, float deltaTime, bool realTime, int width, int height, void *&pixelsContext) {
     return NULL;
 }
 
+void LogicalObject::releasePixels(void *pixelsContext) { }
+
 bool LogicalObject::startExport() {
     return false;
 }
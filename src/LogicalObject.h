@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 /// Represents an abstract Shadron object (such as an animation or an export)
@@ -26,9 +27,15 @@ public:
     virtual bool restart();
     virtual bool setExpressionValue(int exprId, ExpressionType type, const void *value);
     virtual bool offerSource(int sourceId) const;
+    /// Returns a buffer for the host to store the source pixels in, or NULL to let the host allocate its own
+    virtual void * getSourcePixelBuffer(int sourceId, int width, int height);
     virtual void setSourcePixels(int sourceId, const void *pixels, int width, int height);
+    /// Takes back a buffer returned by getSourcePixelBuffer once the host has posted its pixels
+    virtual void releaseSourcePixelBuffer(int sourceId, void *buffer);
     virtual bool pixelsReady() const;
-    virtual const void * fetchPixels(float time, float deltaTime, bool realTime, int width, int height);
+    /// Returns the pixels for the given time, which must remain valid until releasePixels is called with the returned pixelsContext
+    virtual const void * fetchPixels(float time, float deltaTime, bool realTime, int width, int height, void *&pixelsContext);
+    virtual void releasePixels(void *pixelsContext);
     virtual bool startExport();
     virtual void finishExport();
     virtual int getExportStepCount() const;
@@ -41,5 +48,11 @@ protected:
 
 private:
     std::string name;
+    // Registry entry maintained by FfmpegExtension
+    int refCount;
+    size_t nameHash;
+    LogicalObject *nextInBucket;
+
+    friend class FfmpegExtension;
 
 };
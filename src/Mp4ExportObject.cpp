@@ -2,26 +2,119 @@
 #include "Mp4ExportObject.h"
 
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <cmath>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 extern "C" {
     #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/dict.h>
     #include <libavformat/avformat.h>
     #include <libswscale/swscale.h>
 }
 #include "fractionApprox.h"
+#include "colorConversion.h"
+#include "WorkerPool.h"
+
+// Minimum height of a horizontal band of the frame converted by a single thread
+#define MIN_BAND_HEIGHT 64
+// Number of frame buffers shared by the conversion and the encoder threads, in addition to one per segment
+#define FRAME_POOL_SIZE 3
+// Memory for frames queued for the encoders of multiple segments, which lets an encoder finish its segment while the following ones are being rendered
+#define FRAME_QUEUE_BUDGET 0x40000000
+// Number of source pixel buffers which may be lent to the host at the same time
+#define SOURCE_BUFFER_COUNT 2
+// Encoder setting which specifies the number of independently encoded segments
+#define SEGMENTS_SETTING "segments"
 
 struct Mp4ExportObject::Mp4ExportData {
     AVRational timeBase;
     AVCodecID codecId;
     AVPixelFormat pixFmt;
+    // The frame pool; frame points to the most recently converted one
+    std::vector<AVFrame *> framePool;
     AVFrame *frame;
+    // Buffers the host reads the source pixels into, lent until the host posts their pixels
+    uint8_t *sourceBuffers[SOURCE_BUFFER_COUNT];
+    bool sourceBufferLent[SOURCE_BUFFER_COUNT];
+    int sourceBufferSize;
     AVFormatContext *fc;
-    AVCodecContext *cc;
     AVIOContext *ioc;
     AVStream *stream;
-    SwsContext *sc;
+    WorkerPool *workers;
+    // Color conversion contexts for horizontal bands of the frame, bandRows holds their boundaries
+    std::vector<SwsContext *> sc;
+    std::vector<int> bandRows;
+    YuvMatrix matrix;
+    bool fullRange;
+    int segmentCount;
+    int segmentLength;
+    std::vector<Segment *> segments;
+    std::mutex mutex;
+    std::condition_variable queueCondition;
+    std::condition_variable poolCondition;
+    bool encoderFailed;
+    bool encoderStopRequested;
+};
+
+/// A range of frames encoded by a separate encoder on its own thread
+struct Mp4ExportObject::Segment {
+    int firstFrame;
+    int frameCount;
+    // Temporary output file, empty if the segment is written directly into the output file
+    std::string filename;
+    AVFormatContext *fc;
+    AVStream *stream;
+    AVCodecContext *cc;
+    // Frames queued for the encoder thread, NULL marks the end of the segment
+    std::deque<AVFrame *> queue;
+    std::thread encoder;
+    bool busy;
 };
 
+static AVDictionary * encoderOptions(const std::string &settings) {
+    AVDictionary *options = NULL;
+    av_dict_parse_string(&options, settings.c_str(), "=", ",", 0);
+    av_dict_set(&options, SEGMENTS_SETTING, NULL, 0);
+    return options;
+}
+
+static void freeConverters(std::vector<SwsContext *> &sc) {
+    for (std::vector<SwsContext *>::iterator it = sc.begin(); it != sc.end(); ++it)
+        sws_freeContext(*it);
+    sc.clear();
+}
+
+static bool createConverters(std::vector<SwsContext *> &sc, std::vector<int> &bandRows, int width, int height, AVPixelFormat pixFmt, YuvMatrix matrix, bool fullRange, int maxBands) {
+    int bands = height/MIN_BAND_HEIGHT;
+    if (bands > maxBands)
+        bands = maxBands;
+    if (bands < 1)
+        bands = 1;
+    bandRows.resize(bands+1);
+    for (int i = 0; i <= bands; ++i)
+        bandRows[i] = (int) ((long long) height*i/bands)&~1;
+    bandRows[bands] = height;
+    for (int i = 0; i < bands; ++i) {
+        int bandHeight = bandRows[i+1]-bandRows[i];
+        SwsContext *bandContext = sws_getContext(width, bandHeight, AV_PIX_FMT_RGBA, width, bandHeight, pixFmt, 0, NULL, NULL, NULL);
+        if (!bandContext) {
+            freeConverters(sc);
+            return false;
+        }
+        const int *coefficients = sws_getCoefficients(matrix == BT709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+        sws_setColorspaceDetails(bandContext, coefficients, 1, coefficients, fullRange ? 1 : 0, 0, 1<<16, 1<<16);
+        sc.push_back(bandContext);
+    }
+    return true;
+}
+
 Mp4ExportObject::Mp4ExportObject(int sourceId, const std::string &filename, Codec codec, PixelFormat pixelFormat, const std::string &settings, int framerateExpr, int durationExpr, float framerate, float duration, const LogicalObject *framerateSource, const LogicalObject *durationSource) : LogicalObject(std::string()), data(new Mp4ExportData), sourceId(sourceId), filename(filename), codec(codec), pixelFormat(pixelFormat), settings(settings), framerateExpr(framerateExpr), durationExpr(durationExpr), framerate(framerate), duration(duration), framerateSource(framerateSource), durationSource(durationSource) {
     step = -1;
     width = 0, height = 0;
@@ -54,18 +147,28 @@ Mp4ExportObject::Mp4ExportObject(int sourceId, const std::string &filename, Code
         default:
             data->pixFmt = AV_PIX_FMT_NONE;
     }
-    data->frame = av_frame_alloc();
+    data->frame = NULL;
+    for (int i = 0; i < SOURCE_BUFFER_COUNT; ++i) {
+        data->sourceBuffers[i] = NULL;
+        data->sourceBufferLent[i] = false;
+    }
+    data->sourceBufferSize = 0;
     data->fc = NULL;
-    data->cc = NULL;
     data->ioc = NULL;
     data->stream = NULL;
-    data->sc = NULL;
+    data->workers = NULL;
+    data->matrix = BT601;
+    data->fullRange = false;
+    data->segmentCount = 1;
+    data->segmentLength = 0;
+    data->encoderFailed = false;
+    data->encoderStopRequested = false;
 }
 
 Mp4ExportObject::~Mp4ExportObject() {
     finishExport();
-    if (data->frame)
-        av_frame_free(&data->frame);
+    for (std::vector<AVFrame *>::iterator it = data->framePool.begin(); it != data->framePool.end(); ++it)
+        av_frame_free(&*it);
     delete data;
 }
 
@@ -104,29 +207,98 @@ bool Mp4ExportObject::offerSource(int sourceId) const {
     return sourceId == this->sourceId;
 }
 
+void * Mp4ExportObject::getSourcePixelBuffer(int sourceId, int width, int height) {
+    if (sourceId != this->sourceId || width <= 0 || height <= 0)
+        return NULL;
+    int size = 4*width*height;
+    if (size != data->sourceBufferSize) {
+        // Buffers of a different size may only be replaced once the host has returned all of them
+        for (int i = 0; i < SOURCE_BUFFER_COUNT; ++i) {
+            if (data->sourceBufferLent[i])
+                return NULL;
+        }
+        freeSourceBuffers();
+        data->sourceBufferSize = size;
+    }
+    // The pixels are converted before the host gets the buffer back, so more than one is only needed if the host requests the next buffer before posting the previous one
+    for (int i = 0; i < SOURCE_BUFFER_COUNT; ++i) {
+        if (!data->sourceBufferLent[i]) {
+            if (!data->sourceBuffers[i] && !(data->sourceBuffers[i] = reinterpret_cast<uint8_t *>(av_malloc(size))))
+                return NULL;
+            data->sourceBufferLent[i] = true;
+            return data->sourceBuffers[i];
+        }
+    }
+    return NULL;
+}
+
+void Mp4ExportObject::releaseSourcePixelBuffer(int sourceId, void *buffer) {
+    for (int i = 0; i < SOURCE_BUFFER_COUNT; ++i) {
+        if (buffer == data->sourceBuffers[i])
+            data->sourceBufferLent[i] = false;
+    }
+}
+
 void Mp4ExportObject::setSourcePixels(int sourceId, const void *pixels, int width, int height) {
-    if (sourceId == this->sourceId && data->frame && step >= 0) {
+    if (sourceId == this->sourceId && step >= 0) {
         if (step == 0) {
-            data->frame->format = data->pixFmt;
-            data->frame->width = width;
-            data->frame->height = height;
-            if (av_frame_get_buffer(data->frame, 32) >= 0) {
-                if ((data->sc = sws_getContext(width, height, AV_PIX_FMT_RGBA, width, height, data->pixFmt, 0, NULL, NULL, NULL))) {
+            bool buffersAllocated = true;
+            // Frames added to the pool by a previous export are only allocated again when needed
+            while ((int) data->framePool.size() > FRAME_POOL_SIZE+data->segmentCount) {
+                av_frame_free(&data->framePool.back());
+                data->framePool.pop_back();
+            }
+            while ((int) data->framePool.size() < FRAME_POOL_SIZE+data->segmentCount)
+                data->framePool.push_back(av_frame_alloc());
+            for (std::vector<AVFrame *>::iterator it = data->framePool.begin(); it != data->framePool.end() && buffersAllocated; ++it) {
+                AVFrame *poolFrame = *it;
+                if (!poolFrame) {
+                    buffersAllocated = false;
+                    break;
+                }
+                av_frame_unref(poolFrame);
+                poolFrame->format = data->pixFmt;
+                poolFrame->width = width;
+                poolFrame->height = height;
+                if (av_frame_get_buffer(poolFrame, 32) < 0)
+                    buffersAllocated = false;
+            }
+            if (buffersAllocated) {
+                if (!data->workers)
+                    data->workers = new WorkerPool;
+                if (createConverters(data->sc, data->bandRows, width, height, data->pixFmt, data->matrix, data->fullRange, data->workers->getThreadCount())) {
                     this->width = width;
                     this->height = height;
                 }
             }
         }
-        if (width == this->width && height == this->height && data->sc) {
-            const uint8_t *invImgData[4] = { reinterpret_cast<const uint8_t *>(pixels)+4*width*(height-1) };
-            int invImgLinesizes[4] = { -4*width };
-            sws_scale(data->sc, invImgData, invImgLinesizes, 0, height, data->frame->data, data->frame->linesize);
+        if (width == this->width && height == this->height && !data->sc.empty()) {
+            AVFrame *frame = acquireFrame();
+            if (!frame)
+                return;
+            data->frame = frame;
+            // Each band is converted as a separate image, flipped vertically
+            int chromaShift = av_pix_fmt_desc_get(data->pixFmt)->log2_chroma_h;
+            data->workers->run((int) data->sc.size(), [&](int band) {
+                int firstRow = data->bandRows[band];
+                int bandHeight = data->bandRows[band+1]-firstRow;
+                uint8_t *bandData[4] = {
+                    frame->data[0]+frame->linesize[0]*firstRow,
+                    frame->data[1]+frame->linesize[1]*(firstRow>>chromaShift),
+                    frame->data[2]+frame->linesize[2]*(firstRow>>chromaShift)
+                };
+                if (rgbaFlippedToYuv(bandData, frame->linesize, reinterpret_cast<const uint8_t *>(pixels)+4*width*(height-firstRow-bandHeight), 4*width, data->pixFmt, width, bandHeight, data->matrix, data->fullRange))
+                    return;
+                const uint8_t *invImgData[4] = { reinterpret_cast<const uint8_t *>(pixels)+4*width*(height-1-firstRow) };
+                int invImgLinesizes[4] = { -4*width };
+                sws_scale(data->sc[band], invImgData, invImgLinesizes, 0, bandHeight, bandData, frame->linesize);
+            });
         }
     }
 }
 
 bool Mp4ExportObject::startExport() {
-    if (data->frame && !data->fc) {
+    if (!data->fc) {
         if (framerateSource) {
             if (!framerateSource->getFramerate(data->timeBase.den, data->timeBase.num))
                 return false;
@@ -138,6 +310,29 @@ bool Mp4ExportObject::startExport() {
                 return false;
         }
         frameCount = (int) ceilf(framerate*duration);
+        data->segmentCount = 1;
+        data->segmentLength = frameCount;
+        {
+            AVDictionary *options = NULL;
+            av_dict_parse_string(&options, settings.c_str(), "=", ",", 0);
+            AVDictionaryEntry *segmentsEntry = av_dict_get(options, SEGMENTS_SETTING, NULL, 0);
+            AVDictionaryEntry *gopEntry = av_dict_get(options, "g", NULL, 0);
+            AVDictionaryEntry *colorspaceEntry = av_dict_get(options, "colorspace", NULL, 0);
+            AVDictionaryEntry *rangeEntry = av_dict_get(options, "color_range", NULL, 0);
+            int segments = segmentsEntry ? atoi(segmentsEntry->value) : 1;
+            int gopSize = gopEntry ? atoi(gopEntry->value) : 0;
+            // The color conversion follows the color properties which the encoder will signal in the video
+            data->matrix = colorspaceEntry && !strcmp(colorspaceEntry->value, "bt709") ? BT709 : BT601;
+            data->fullRange = rangeEntry && (!strcmp(rangeEntry->value, "pc") || !strcmp(rangeEntry->value, "jpeg"));
+            av_dict_free(&options);
+            if (segments > 1 && frameCount > 1) {
+                // Segment boundaries are aligned to keyframe intervals if the interval is fixed by the settings
+                data->segmentLength = (frameCount+segments-1)/segments;
+                if (gopSize > 0)
+                    data->segmentLength = (data->segmentLength+gopSize-1)/gopSize*gopSize;
+                data->segmentCount = (frameCount+data->segmentLength-1)/data->segmentLength;
+            }
+        }
         if (avformat_alloc_output_context2(&data->fc, NULL, "mp4", NULL) >= 0) {
             data->stream = avformat_new_stream(data->fc, NULL);
             if (data->stream) {
@@ -152,15 +347,19 @@ bool Mp4ExportObject::startExport() {
 }
 
 void Mp4ExportObject::finishExport() {
-    if (data->sc) {
-        sws_freeContext(data->sc);
-        data->sc = NULL;
+    closeSegments();
+    data->frame = NULL;
+    for (std::vector<AVFrame *>::iterator it = data->framePool.begin(); it != data->framePool.end(); ++it) {
+        if (*it)
+            av_frame_unref(*it);
     }
-    data->stream = NULL;
-    if (data->cc) {
-        avcodec_close(data->cc);
-        avcodec_free_context(&data->cc);
+    freeConverters(data->sc);
+    freeSourceBuffers();
+    if (data->workers) {
+        delete data->workers;
+        data->workers = NULL;
     }
+    data->stream = NULL;
     if (data->ioc)
         avio_closep(&data->ioc);
     if (data->fc) {
@@ -185,7 +384,7 @@ bool Mp4ExportObject::prepareExportStep(int step, float &time, float &deltaTime)
 }
 
 bool Mp4ExportObject::exportStep() {
-    if (!(data->frame && data->fc && data->stream && step >= 0 && step < frameCount))
+    if (!(data->fc && data->stream && step >= 0 && step < frameCount))
         return false;
     if (step == 0) {
         if (pixelFormat == YUV420 && (width&1 || height&1))
@@ -193,65 +392,273 @@ bool Mp4ExportObject::exportStep() {
         if (avio_open2(&data->fc->pb, filename.c_str(), AVIO_FLAG_WRITE, NULL, NULL) < 0)
             return false;
         data->ioc = data->fc->pb;
-        AVCodec *codec = avcodec_find_encoder(data->codecId);
-        if (!codec)
+        for (int i = 0; i < data->segmentCount; ++i) {
+            if (!openSegment(i*data->segmentLength))
+                return false;
+        }
+        if (data->segmentCount > 1 && !segmentHeadersMatch()) {
+            // The segments could not be joined in the end, encode the whole video by a single encoder instead
+            closeSegments();
+            data->segmentCount = 1;
+            data->segmentLength = frameCount;
+            if (!openSegment(0))
+                return false;
+        }
+    }
+    if (data->segments.empty() || !data->frame)
+        return false;
+    // Frames are rendered in order and handed to the encoder of the segment they belong to
+    int frameIndex = step;
+    Segment *segment = data->segments[frameIndex/data->segmentLength];
+    AVFrame *frame = av_frame_clone(data->frame);
+    if (!frame)
+        return false;
+    frame->pts = frameIndex-segment->firstFrame;
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        if (data->encoderFailed) {
+            av_frame_free(&frame);
             return false;
-        data->cc = avcodec_alloc_context3(codec);
-        data->cc->codec_type = AVMEDIA_TYPE_VIDEO;
-        data->cc->width = width;
-        data->cc->height = height;
-        data->cc->sample_aspect_ratio.num = 1;
-        data->cc->sample_aspect_ratio.den = 1;
-        data->cc->time_base = data->timeBase;
-        data->cc->pix_fmt = data->pixFmt;
-        data->cc->framerate.num = data->timeBase.den;
-        data->cc->framerate.den = data->timeBase.num;
-        if (data->fc->oformat->flags&AVFMT_GLOBALHEADER)
-            data->cc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-        AVDictionary *options = NULL;
-        av_dict_parse_string(&options, settings.c_str(), "=", ",", 0);
-        if (avcodec_open2(data->cc, codec, &options) < 0) {
-            avcodec_free_context(&data->cc);
-            av_dict_free(&options);
+        }
+        segment->queue.push_back(frame);
+        if (frameIndex == segment->firstFrame+segment->frameCount-1)
+            segment->queue.push_back(NULL);
+        data->queueCondition.notify_all();
+    }
+    if (step == frameCount-1) {
+        for (std::vector<Segment *>::iterator it = data->segments.begin(); it != data->segments.end(); ++it)
+            (*it)->encoder.join();
+        if (data->encoderFailed)
             return false;
+        if (data->segments.size() > 1)
+            return concatenateSegments();
+    }
+    return true;
+}
+
+void Mp4ExportObject::freeSourceBuffers() {
+    for (int i = 0; i < SOURCE_BUFFER_COUNT; ++i) {
+        av_freep(&data->sourceBuffers[i]);
+        data->sourceBufferLent[i] = false;
+    }
+    data->sourceBufferSize = 0;
+}
+
+AVFrame * Mp4ExportObject::acquireFrame() {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (!data->encoderFailed) {
+        // A frame is free once the encoders have released all of their references to its buffers
+        for (std::vector<AVFrame *>::iterator it = data->framePool.begin(); it != data->framePool.end(); ++it) {
+            if (av_frame_is_writable(*it))
+                return *it;
+        }
+        bool encodersIdle = true;
+        for (std::vector<Segment *>::const_iterator it = data->segments.begin(); it != data->segments.end(); ++it)
+            encodersIdle = encodersIdle && (*it)->queue.empty() && !(*it)->busy;
+        // Encoders of earlier segments which are still busy may fall behind by up to the budget, so that they keep working alongside the current one
+        if (!encodersIdle && data->segmentCount > 1 && (long long) (data->framePool.size()+1)*av_image_get_buffer_size(data->pixFmt, width, height, 32) <= FRAME_QUEUE_BUDGET) {
+            AVFrame *frame = av_frame_alloc();
+            if (frame) {
+                data->framePool.push_back(frame);
+                frame->format = data->pixFmt;
+                frame->width = width;
+                frame->height = height;
+                if (av_frame_get_buffer(frame, 32) >= 0)
+                    return frame;
+                return NULL;
+            }
+        }
+        if (encodersIdle) {
+            // The encoders keep references to the frames they have consumed, give one of them new buffers
+            AVFrame *frame = data->framePool[data->framePool[0] == data->frame ? 1 : 0];
+            av_frame_unref(frame);
+            frame->format = data->pixFmt;
+            frame->width = width;
+            frame->height = height;
+            if (av_frame_get_buffer(frame, 32) >= 0)
+                return frame;
+            return NULL;
         }
+        data->poolCondition.wait(lock);
+    }
+    return NULL;
+}
+
+bool Mp4ExportObject::openSegment(int firstFrame) {
+    Segment *segment = new Segment;
+    segment->firstFrame = firstFrame;
+    segment->frameCount = std::min(data->segmentLength, frameCount-firstFrame);
+    segment->fc = NULL;
+    segment->stream = NULL;
+    segment->cc = NULL;
+    segment->busy = false;
+    data->segments.push_back(segment);
+    if (data->segmentCount == 1) {
+        segment->fc = data->fc;
+        segment->stream = data->stream;
+    } else {
+        // Segments are stored in NUT files, which preserve the timestamps exactly
+        char suffix[32];
+        sprintf(suffix, ".part%d", (int) data->segments.size()-1);
+        segment->filename = filename+suffix;
+        if (avformat_alloc_output_context2(&segment->fc, NULL, "nut", segment->filename.c_str()) < 0)
+            return false;
+        if (!(segment->stream = avformat_new_stream(segment->fc, NULL)))
+            return false;
+        segment->stream->time_base = data->timeBase;
+        if (avio_open2(&segment->fc->pb, segment->filename.c_str(), AVIO_FLAG_WRITE, NULL, NULL) < 0)
+            return false;
+    }
+    AVCodec *codec = avcodec_find_encoder(data->codecId);
+    if (!codec)
+        return false;
+    if (!(segment->cc = avcodec_alloc_context3(codec)))
+        return false;
+    segment->cc->codec_type = AVMEDIA_TYPE_VIDEO;
+    segment->cc->width = width;
+    segment->cc->height = height;
+    segment->cc->sample_aspect_ratio.num = 1;
+    segment->cc->sample_aspect_ratio.den = 1;
+    segment->cc->time_base = data->timeBase;
+    segment->cc->pix_fmt = data->pixFmt;
+    segment->cc->framerate.num = data->timeBase.den;
+    segment->cc->framerate.den = data->timeBase.num;
+    // The final output format decides about global headers so that all segments share the same stream parameters
+    if (data->fc->oformat->flags&AVFMT_GLOBALHEADER)
+        segment->cc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    AVDictionary *options = encoderOptions(settings);
+    if (avcodec_open2(segment->cc, codec, &options) < 0) {
         av_dict_free(&options);
-        if (avcodec_parameters_from_context(data->stream->codecpar, data->cc) < 0 || avformat_write_header(data->fc, NULL) < 0) {
-            avcodec_free_context(&data->cc);
+        return false;
+    }
+    av_dict_free(&options);
+    if (avcodec_parameters_from_context(segment->stream->codecpar, segment->cc) < 0 || avformat_write_header(segment->fc, NULL) < 0)
+        return false;
+    segment->encoder = std::thread(&Mp4ExportObject::encodeFrames, this, segment);
+    return true;
+}
+
+void Mp4ExportObject::closeSegments() {
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        data->encoderStopRequested = true;
+        data->queueCondition.notify_all();
+    }
+    for (std::vector<Segment *>::iterator it = data->segments.begin(); it != data->segments.end(); ++it) {
+        Segment *segment = *it;
+        if (segment->encoder.joinable())
+            segment->encoder.join();
+        for (std::deque<AVFrame *>::iterator frame = segment->queue.begin(); frame != segment->queue.end(); ++frame)
+            av_frame_free(&*frame);
+        if (segment->cc) {
+            avcodec_close(segment->cc);
+            avcodec_free_context(&segment->cc);
+        }
+        if (segment->fc && segment->fc != data->fc) {
+            if (segment->fc->pb)
+                avio_closep(&segment->fc->pb);
+            avformat_free_context(segment->fc);
+        }
+        if (!segment->filename.empty())
+            remove(segment->filename.c_str());
+        delete segment;
+    }
+    data->segments.clear();
+    data->encoderFailed = false;
+    data->encoderStopRequested = false;
+}
+
+void Mp4ExportObject::encodeFrames(Segment *segment) {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (!data->encoderStopRequested) {
+        if (segment->queue.empty()) {
+            data->queueCondition.wait(lock);
+            continue;
+        }
+        AVFrame *frame = segment->queue.front();
+        segment->queue.pop_front();
+        segment->busy = true;
+        lock.unlock();
+        bool lastFrame = !frame;
+        bool ok = avcodec_send_frame(segment->cc, frame) == 0;
+        if (frame)
+            av_frame_free(&frame);
+        if (ok)
+            ok = writePackets(segment);
+        if (ok && lastFrame)
+            ok = av_write_trailer(segment->fc) == 0;
+        lock.lock();
+        segment->busy = false;
+        data->poolCondition.notify_all();
+        if (!ok) {
+            data->encoderFailed = true;
+            break;
+        }
+        if (lastFrame)
+            break;
+    }
+}
+
+bool Mp4ExportObject::writePackets(Segment *segment) {
+    AVPacket pkt = { };
+    av_init_packet(&pkt);
+    while (avcodec_receive_packet(segment->cc, &pkt) == 0) {
+        pkt.stream_index = segment->stream->index;
+        av_packet_rescale_ts(&pkt, data->timeBase, segment->stream->time_base);
+        if (av_interleaved_write_frame(segment->fc, &pkt) != 0) {
+            av_packet_unref(&pkt);
             return false;
         }
+        av_packet_unref(&pkt);
+    }
+    return true;
+}
+
+bool Mp4ExportObject::segmentHeadersMatch() const {
+    // The bitstreams may only be joined if all encoders produced identical stream headers
+    const AVCodecContext *firstCc = data->segments[0]->cc;
+    for (std::vector<Segment *>::const_iterator it = data->segments.begin(); it != data->segments.end(); ++it) {
+        const AVCodecContext *cc = (*it)->cc;
+        if (cc->extradata_size != firstCc->extradata_size || (cc->extradata_size > 0 && memcmp(cc->extradata, firstCc->extradata, cc->extradata_size)))
+            return false;
     }
-    if (!data->cc)
+    return true;
+}
+
+bool Mp4ExportObject::concatenateSegments() {
+    const AVCodecContext *firstCc = data->segments[0]->cc;
+    if (avcodec_parameters_from_context(data->stream->codecpar, firstCc) < 0 || avformat_write_header(data->fc, NULL) < 0)
         return false;
-    {
-        data->frame->pts = step;
-        if (avcodec_send_frame(data->cc, data->frame) != 0)
+    int64_t lastDts = AV_NOPTS_VALUE;
+    for (std::vector<Segment *>::iterator it = data->segments.begin(); it != data->segments.end(); ++it) {
+        Segment *segment = *it;
+        avio_closep(&segment->fc->pb);
+        AVFormatContext *input = NULL;
+        if (avformat_open_input(&input, segment->filename.c_str(), NULL, NULL) < 0)
             return false;
         AVPacket pkt = { };
         av_init_packet(&pkt);
-        while (avcodec_receive_packet(data->cc, &pkt) == 0) {
+        while (av_read_frame(input, &pkt) == 0) {
+            av_packet_rescale_ts(&pkt, input->streams[pkt.stream_index]->time_base, data->timeBase);
+            if (pkt.pts != AV_NOPTS_VALUE)
+                pkt.pts += segment->firstFrame;
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                pkt.dts += segment->firstFrame;
+                // Keep decoding timestamps strictly increasing across segment boundaries
+                if (lastDts != AV_NOPTS_VALUE && pkt.dts <= lastDts)
+                    pkt.dts = lastDts+1;
+                lastDts = pkt.dts;
+            }
             pkt.stream_index = data->stream->index;
             av_packet_rescale_ts(&pkt, data->timeBase, data->stream->time_base);
             if (av_interleaved_write_frame(data->fc, &pkt) != 0) {
                 av_packet_unref(&pkt);
+                avformat_close_input(&input);
                 return false;
             }
             av_packet_unref(&pkt);
         }
-        if (step == frameCount-1) {
-            if (avcodec_send_frame(data->cc, NULL) != 0)
-                return false;
-            while (avcodec_receive_packet(data->cc, &pkt) == 0) {
-                pkt.stream_index = data->stream->index;
-                av_packet_rescale_ts(&pkt, data->timeBase, data->stream->time_base);
-                if (av_interleaved_write_frame(data->fc, &pkt) != 0) {
-                    av_packet_unref(&pkt);
-                    return false;
-                }
-                av_packet_unref(&pkt);
-            }
-            av_write_trailer(data->fc);
-        }
+        avformat_close_input(&input);
     }
-    return true;
+    return av_write_trailer(data->fc) == 0;
 }
@@ -4,6 +4,8 @@
 #include <string>
 #include "LogicalObject.h"
 
+struct AVFrame;
+
 /// MP4 file export
 class Mp4ExportObject : public LogicalObject {
 
@@ -25,7 +27,9 @@ public:
     Mp4ExportObject * reconfigure(int sourceId, const std::string &filename, Codec codec, PixelFormat pixelFormat, const std::string &settings, int framerateExpr, int durationExpr, float framerate, float duration, const LogicalObject *framerateSource, const LogicalObject *durationSource);
     virtual bool setExpressionValue(int exprId, ExpressionType type, const void *value) override;
     virtual bool offerSource(int sourceId) const override;
+    virtual void * getSourcePixelBuffer(int sourceId, int width, int height) override;
     virtual void setSourcePixels(int sourceId, const void *pixels, int width, int height) override;
+    virtual void releaseSourcePixelBuffer(int sourceId, void *buffer) override;
     virtual bool startExport() override;
     virtual void finishExport() override;
     virtual int getExportStepCount() const override;
@@ -35,6 +39,7 @@ public:
 
 private:
     struct Mp4ExportData;
+    struct Segment;
 
     Mp4ExportData *data;
     int sourceId;
@@ -53,4 +58,13 @@ private:
     int step;
     int width, height;
 
+    void freeSourceBuffers();
+    AVFrame * acquireFrame();
+    bool openSegment(int firstFrame);
+    void closeSegments();
+    void encodeFrames(Segment *segment);
+    bool writePackets(Segment *segment);
+    bool segmentHeadersMatch() const;
+    bool concatenateSegments();
+
 };
@@ -0,0 +1,401 @@
+
+#include "SampleCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <utime.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#define CACHE_MAGIC "SHFFPCM1"
+#define CACHE_SUBDIRECTORY "shadron-ffmpeg-cache"
+// Samples shorter than this many bytes decode fast enough not to be cached
+#define MIN_CACHED_SIZE 0x100000
+// Total size of cache files above which the least recently used ones are removed
+#define MAX_CACHE_SIZE 0x40000000ull
+// Size of samples waiting to be written by a Writer above which further ones are not cached
+#define MAX_PENDING_SIZE 0x10000000
+
+/// Header at the start of a cache file, followed by the samples
+struct CacheHeader {
+    char magic[8];
+    uint64_t dataHash;
+    uint64_t dataLength;
+    uint32_t format;
+    int32_t sampleRate;
+    int32_t sampleCount;
+    uint32_t reserved;
+};
+
+static inline uint64_t rotateLeft(uint64_t x, int bits) {
+    return x<<bits|x>>(64-bits);
+}
+
+// A multiply-rotate hash with four independent lanes so that the file is hashed at memory speed
+static uint64_t hashData(const unsigned char *data, size_t length) {
+    const uint64_t prime1 = 0x9e3779b185ebca87ull, prime2 = 0xc2b2ae3d27d4eb4full, prime3 = 0x165667b19e3779f9ull;
+    uint64_t lanes[4] = { prime1+prime2, prime2, 0, 0-prime1 };
+    size_t pos = 0;
+    for (; pos+32 <= length; pos += 32) {
+        for (int i = 0; i < 4; ++i) {
+            uint64_t word;
+            memcpy(&word, data+pos+8*i, 8);
+            lanes[i] = rotateLeft(lanes[i]+word*prime2, 31)*prime1;
+        }
+    }
+    uint64_t hash = rotateLeft(lanes[0], 1)+rotateLeft(lanes[1], 7)+rotateLeft(lanes[2], 12)+rotateLeft(lanes[3], 18)+length;
+    for (; pos < length; ++pos)
+        hash = rotateLeft(hash^data[pos]*prime3, 11)*prime1;
+    hash ^= hash>>33;
+    hash *= prime2;
+    hash ^= hash>>29;
+    hash *= prime3;
+    hash ^= hash>>32;
+    return hash;
+}
+
+/// A file of the cache directory considered for removal
+struct CacheFile {
+    std::string path;
+    uint64_t size;
+    uint64_t lastUsed;
+};
+
+struct SampleCache::Writer::WriterData {
+    struct Job {
+        Key key;
+        int sampleRate;
+        int sampleCount;
+        std::vector<std::vector<unsigned char> > sampleChunks;
+        size_t size;
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Job *> jobs;
+    size_t pendingSize;
+    bool stopRequested;
+};
+
+// Distinguishes temporary files of the same process
+static std::atomic<unsigned> tempFileCounter(0);
+
+static bool headerMatches(const CacheHeader &header, const SampleCache::Key &key) {
+    return !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) && header.dataHash == key.dataHash && header.dataLength == key.dataLength && header.format == key.format && header.sampleRate > 0 && header.sampleCount >= 0;
+}
+
+SampleCache::Key SampleCache::key(const void *data, int length, uint32_t format) {
+    Key key;
+    key.dataHash = hashData(reinterpret_cast<const unsigned char *>(data), (size_t) length);
+    key.dataLength = (uint64_t) length;
+    key.format = format;
+    return key;
+}
+
+bool SampleCache::find(const Key &key, int &sampleRate, int &sampleCount) {
+    std::string path = filename(key);
+    if (path.empty())
+        return false;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    CacheHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && headerMatches(header, key);
+    fclose(file);
+    if (ok) {
+        sampleRate = header.sampleRate;
+        sampleCount = header.sampleCount;
+    }
+    return ok;
+}
+
+bool SampleCache::read(const Key &key, void *output, int samples, int sampleSize) {
+    std::string path = filename(key);
+    if (path.empty())
+        return false;
+    const unsigned char *contents = NULL;
+    size_t fileSize = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ|FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    HANDLE mapping = NULL;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && (mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+        contents = reinterpret_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        fileSize = (size_t) size.QuadPart;
+    }
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+    struct stat fileStat;
+    if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0) {
+        void *mapped = mmap(NULL, (size_t) fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapped != MAP_FAILED) {
+            contents = reinterpret_cast<const unsigned char *>(mapped);
+            fileSize = (size_t) fileStat.st_size;
+        }
+    }
+#endif
+    bool ok = false;
+    if (contents && fileSize >= sizeof(CacheHeader)) {
+        CacheHeader header;
+        memcpy(&header, contents, sizeof(header));
+        size_t dataSize = (size_t) sampleSize*header.sampleCount;
+        if (headerMatches(header, key) && fileSize-sizeof(header) >= dataSize) {
+            size_t outputSize = (size_t) sampleSize*samples;
+            size_t copySize = dataSize < outputSize ? dataSize : outputSize;
+            memcpy(output, contents+sizeof(header), copySize);
+            memset(reinterpret_cast<unsigned char *>(output)+copySize, 0, outputSize-copySize);
+            ok = true;
+        }
+    }
+    // The modification time marks the file as recently used
+#ifdef _WIN32
+    if (contents)
+        UnmapViewOfFile(contents);
+    if (mapping)
+        CloseHandle(mapping);
+    if (ok) {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, NULL, NULL, &now);
+    }
+    CloseHandle(file);
+#else
+    if (contents)
+        munmap(const_cast<unsigned char *>(contents), fileSize);
+    close(file);
+    if (ok)
+        utime(path.c_str(), NULL);
+#endif
+    return ok;
+}
+
+bool SampleCache::store(const Key &key, int sampleRate, int sampleCount, const std::vector<std::vector<unsigned char> > &sampleChunks) {
+    std::vector<const void *> parts;
+    std::vector<size_t> partSizes;
+    for (std::vector<std::vector<unsigned char> >::const_iterator it = sampleChunks.begin(); it != sampleChunks.end(); ++it) {
+        if (!it->empty()) {
+            parts.push_back(&(*it)[0]);
+            partSizes.push_back(it->size());
+        }
+    }
+    return write(key, sampleRate, sampleCount, parts.empty() ? NULL : &parts[0], partSizes.empty() ? NULL : &partSizes[0], (int) parts.size());
+}
+
+bool SampleCache::store(const Key &key, int sampleRate, int sampleCount, const void *samples, size_t size) {
+    return write(key, sampleRate, sampleCount, &samples, &size, 1);
+}
+
+std::string SampleCache::directory() {
+    std::string path;
+#ifdef _WIN32
+    if (const char *localAppData = getenv("LOCALAPPDATA")) {
+        path = std::string(localAppData)+"\\" CACHE_SUBDIRECTORY;
+        CreateDirectoryA(path.c_str(), NULL);
+        path += "\\";
+    }
+#else
+    if (const char *cacheHome = getenv("XDG_CACHE_HOME"))
+        path = cacheHome;
+    else if (const char *home = getenv("HOME")) {
+        path = std::string(home)+"/.cache";
+        mkdir(path.c_str(), 0700);
+    } else
+        return std::string();
+    path += "/" CACHE_SUBDIRECTORY;
+    mkdir(path.c_str(), 0700);
+    path += "/";
+#endif
+    return path;
+}
+
+std::string SampleCache::filename(const Key &key) {
+    std::string path = directory();
+    if (path.empty())
+        return path;
+    char name[64];
+    sprintf(name, "%016llx-%llx-%x.pcm", (unsigned long long) key.dataHash, (unsigned long long) key.dataLength, (unsigned) key.format);
+    return path+name;
+}
+
+bool SampleCache::write(const Key &key, int sampleRate, int sampleCount, const void *const *parts, const size_t *partSizes, int partCount) {
+    size_t totalSize = 0;
+    for (int i = 0; i < partCount; ++i)
+        totalSize += partSizes[i];
+    if (totalSize < MIN_CACHED_SIZE)
+        return false;
+    std::string path = filename(key);
+    if (path.empty())
+        return false;
+    // The file is written under a temporary name first so that a partially written file is never found, unique across processes sharing the cache
+    char suffix[48];
+#ifdef _WIN32
+    unsigned long processId = (unsigned long) GetCurrentProcessId();
+#else
+    unsigned long processId = (unsigned long) getpid();
+#endif
+    sprintf(suffix, ".%lu-%u.tmp", processId, tempFileCounter++);
+    std::string tempPath = path+suffix;
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (!file)
+        return false;
+    CacheHeader header = { };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.dataHash = key.dataHash;
+    header.dataLength = key.dataLength;
+    header.format = key.format;
+    header.sampleRate = sampleRate;
+    header.sampleCount = sampleCount;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < partCount && ok; ++i)
+        ok = fwrite(parts[i], 1, partSizes[i], file) == partSizes[i];
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok)
+        remove(tempPath.c_str());
+    else
+        trim();
+    return ok;
+}
+
+void SampleCache::trim() {
+    std::string path = directory();
+    if (path.empty())
+        return;
+    std::vector<CacheFile> files;
+    uint64_t totalSize = 0;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((path+"*.pcm").c_str(), &found);
+    if (search != INVALID_HANDLE_VALUE) {
+        do {
+            CacheFile file;
+            file.path = path+found.cFileName;
+            file.size = (uint64_t) found.nFileSizeHigh<<32|found.nFileSizeLow;
+            file.lastUsed = (uint64_t) found.ftLastWriteTime.dwHighDateTime<<32|found.ftLastWriteTime.dwLowDateTime;
+            totalSize += file.size;
+            files.push_back(file);
+        } while (FindNextFileA(search, &found));
+        FindClose(search);
+    }
+#else
+    if (DIR *dir = opendir(path.c_str())) {
+        while (struct dirent *entry = readdir(dir)) {
+            size_t nameLength = strlen(entry->d_name);
+            struct stat fileStat;
+            CacheFile file;
+            file.path = path+entry->d_name;
+            if (nameLength > 4 && !strcmp(entry->d_name+nameLength-4, ".pcm") && stat(file.path.c_str(), &fileStat) == 0) {
+                file.size = (uint64_t) fileStat.st_size;
+                file.lastUsed = (uint64_t) fileStat.st_mtime;
+                totalSize += file.size;
+                files.push_back(file);
+            }
+        }
+        closedir(dir);
+    }
+#endif
+    if (totalSize <= MAX_CACHE_SIZE)
+        return;
+    std::sort(files.begin(), files.end(), [](const CacheFile &a, const CacheFile &b) {
+        return a.lastUsed < b.lastUsed;
+    });
+    for (std::vector<CacheFile>::const_iterator file = files.begin(); file != files.end() && totalSize > MAX_CACHE_SIZE; ++file) {
+        if (remove(file->path.c_str()) == 0)
+            totalSize -= file->size;
+    }
+}
+
+SampleCache::Writer::Writer() : data(new WriterData) {
+    data->pendingSize = 0;
+    data->stopRequested = false;
+    data->thread = std::thread(&Writer::work, this);
+}
+
+SampleCache::Writer::~Writer() {
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        data->stopRequested = true;
+        data->condition.notify_all();
+    }
+    data->thread.join();
+    for (std::deque<WriterData::Job *>::iterator job = data->jobs.begin(); job != data->jobs.end(); ++job)
+        delete *job;
+    delete data;
+}
+
+bool SampleCache::Writer::store(const Key &key, int sampleRate, int sampleCount, std::vector<std::vector<unsigned char> > &&sampleChunks) {
+    size_t size = 0;
+    for (std::vector<std::vector<unsigned char> >::const_iterator it = sampleChunks.begin(); it != sampleChunks.end(); ++it)
+        size += it->size();
+    if (size < MIN_CACHED_SIZE)
+        return false;
+    std::lock_guard<std::mutex> lock(data->mutex);
+    if (data->pendingSize+size > MAX_PENDING_SIZE)
+        return false;
+    WriterData::Job *job = new WriterData::Job;
+    job->key = key;
+    job->sampleRate = sampleRate;
+    job->sampleCount = sampleCount;
+    job->sampleChunks = (std::vector<std::vector<unsigned char> > &&) sampleChunks;
+    job->size = size;
+    data->jobs.push_back(job);
+    data->pendingSize += size;
+    data->condition.notify_all();
+    return true;
+}
+
+bool SampleCache::Writer::store(const Key &key, int sampleRate, int sampleCount, const void *samples, size_t size) {
+    if (size < MIN_CACHED_SIZE)
+        return false;
+    {
+        // Checked before the samples are copied, but again when they are queued
+        std::lock_guard<std::mutex> lock(data->mutex);
+        if (data->pendingSize+size > MAX_PENDING_SIZE)
+            return false;
+    }
+    std::vector<std::vector<unsigned char> > sampleChunks(1);
+    sampleChunks[0].assign(reinterpret_cast<const unsigned char *>(samples), reinterpret_cast<const unsigned char *>(samples)+size);
+    return store(key, sampleRate, sampleCount, (std::vector<std::vector<unsigned char> > &&) sampleChunks);
+}
+
+void SampleCache::Writer::work() {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (!data->stopRequested) {
+        if (data->jobs.empty()) {
+            data->condition.wait(lock);
+            continue;
+        }
+        WriterData::Job *job = data->jobs.front();
+        data->jobs.pop_front();
+        lock.unlock();
+        SampleCache::store(job->key, job->sampleRate, job->sampleCount, job->sampleChunks);
+        size_t size = job->size;
+        delete job;
+        lock.lock();
+        data->pendingSize -= size;
+    }
+}
@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Persistent on-disk cache of decoded sound samples, stored in files which are memory-mapped when read. The least recently used files are removed when the cache exceeds its size limit.
+class SampleCache {
+
+public:
+    class Writer;
+
+    /// Identifies decoded samples by the contents of the encoded file and the output sample format
+    struct Key {
+        uint64_t dataHash;
+        uint64_t dataLength;
+        uint32_t format;
+    };
+
+    static Key key(const void *data, int length, uint32_t format);
+    /// Looks up the sample rate and count of cached samples. Returns false if they are not cached.
+    static bool find(const Key &key, int &sampleRate, int &sampleCount);
+    /// Copies up to samples cached samples of sampleSize bytes into output
+    static bool read(const Key &key, void *output, int samples, int sampleSize);
+    /// Stores samples given as consecutive chunks
+    static bool store(const Key &key, int sampleRate, int sampleCount, const std::vector<std::vector<unsigned char> > &sampleChunks);
+    static bool store(const Key &key, int sampleRate, int sampleCount, const void *samples, size_t size);
+
+private:
+    static std::string directory();
+    static std::string filename(const Key &key);
+    static bool write(const Key &key, int sampleRate, int sampleCount, const void *const *parts, const size_t *partSizes, int partCount);
+    /// Removes the least recently used files until the total size is within the limit
+    static void trim();
+
+};
+
+/// Stores samples in the cache on a background thread
+class SampleCache::Writer {
+
+public:
+    Writer();
+    Writer(const Writer &) = delete;
+    /// Finishes the file being written, the remaining ones are abandoned
+    ~Writer();
+    Writer & operator=(const Writer &) = delete;
+    /// Queues chunks of samples for storing and takes them over. Returns false if too much data is already waiting to be written.
+    bool store(const Key &key, int sampleRate, int sampleCount, std::vector<std::vector<unsigned char> > &&sampleChunks);
+    /// Queues a copy of samples for storing
+    bool store(const Key &key, int sampleRate, int sampleCount, const void *samples, size_t size);
+
+private:
+    struct WriterData;
+
+    WriterData *data;
+
+    void work();
+
+};
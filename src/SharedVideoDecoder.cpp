@@ -0,0 +1,189 @@
+
+#include "SharedVideoDecoder.h"
+
+// Maximum number of consumers of a single shared decoder, each of which needs additional frame buffers
+#define MAX_SHARED_CONSUMERS 4
+// Number of frame buffers held by each consumer, the current frame and one leased to the host
+#define FRAMES_PER_CONSUMER 2
+
+SharedVideoDecoder::Pool::Pool() { }
+
+SharedVideoDecoder::Pool::~Pool() {
+    for (std::multimap<std::string, SharedVideoDecoder *>::iterator it = decoders.begin(); it != decoders.end(); ++it)
+        delete it->second;
+}
+
+SharedVideoDecoder * SharedVideoDecoder::Pool::acquire(const std::string &filename, VideoDecoder::ThreadingMode threading, int threadCount, Consumer &consumer) {
+    std::pair<std::multimap<std::string, SharedVideoDecoder *>::iterator, std::multimap<std::string, SharedVideoDecoder *>::iterator> range = decoders.equal_range(filename);
+    for (std::multimap<std::string, SharedVideoDecoder *>::iterator it = range.first; it != range.second; ++it) {
+        SharedVideoDecoder *shared = it->second;
+        if (shared->threading == threading && shared->threadCount == threadCount && shared->consumerCount < MAX_SHARED_CONSUMERS && shared->decoder->addFrames(FRAMES_PER_CONSUMER)) {
+            shared->attach(consumer);
+            return shared;
+        }
+    }
+    if (VideoDecoder *decoder = VideoDecoder::open(filename.c_str(), threading, threadCount)) {
+        SharedVideoDecoder *shared = new SharedVideoDecoder(decoder, threading, threadCount);
+        decoders.insert(std::make_pair(filename, shared));
+        shared->attach(consumer);
+        return shared;
+    }
+    return NULL;
+}
+
+void SharedVideoDecoder::Pool::release(SharedVideoDecoder *decoder) {
+    if (!decoder)
+        return;
+    if (--decoder->consumerCount > 0) {
+        decoder->decoder->removeFrames(FRAMES_PER_CONSUMER);
+        return;
+    }
+    for (std::multimap<std::string, SharedVideoDecoder *>::iterator it = decoders.begin(); it != decoders.end(); ++it) {
+        if (it->second == decoder) {
+            decoders.erase(it);
+            break;
+        }
+    }
+    delete decoder;
+}
+
+SharedVideoDecoder::SharedVideoDecoder(VideoDecoder *decoder, VideoDecoder::ThreadingMode threading, int threadCount) : decoder(decoder), threading(threading), threadCount(threadCount), consumerCount(0), latestFrame(NULL), sequence(1), lastOperation(NONE), runStart(1), skipMode(VideoDecoder::SKIP_NONE), repeat(false), atStart(true) {
+    for (int i = 0; i <= VideoDecoder::SKIP_NONKEY; ++i)
+        skipModeConsumers[i] = 0;
+}
+
+SharedVideoDecoder::~SharedVideoDecoder() {
+    decoder->releaseFrame(latestFrame);
+    delete decoder;
+}
+
+VideoDecoder * SharedVideoDecoder::getDecoder() {
+    return decoder;
+}
+
+bool SharedVideoDecoder::setRepeat(bool repeat) {
+    if (repeat != this->repeat) {
+        if (consumerCount > 1)
+            return false;
+        this->repeat = repeat;
+        decoder->setRepeat(repeat);
+    }
+    return true;
+}
+
+void SharedVideoDecoder::setSkipMode(Consumer &consumer, VideoDecoder::SkipMode mode) {
+    if (mode != consumer.skipMode) {
+        --skipModeConsumers[consumer.skipMode];
+        ++skipModeConsumers[mode];
+        consumer.skipMode = mode;
+        updateSkipMode();
+    }
+}
+
+void SharedVideoDecoder::leaveLockstep(Consumer &consumer) {
+    --skipModeConsumers[consumer.skipMode];
+    consumer.skipMode = VideoDecoder::SKIP_NONE;
+    updateSkipMode();
+}
+
+void SharedVideoDecoder::seekKeyframe(Consumer &consumer, long long timestamp) {
+    // A consumer behind the others is about to jump to the latest frame anyway
+    if (consumer.sequence == sequence)
+        decoder->seekKeyframe(timestamp);
+}
+
+bool SharedVideoDecoder::rewind(Consumer &consumer) {
+    if (!follows(consumer, REWIND))
+        return false;
+    if (!atStart) {
+        decoder->releaseFrame(latestFrame);
+        latestFrame = NULL;
+        decoder->rewind();
+        advance(REWIND);
+        atStart = true;
+    }
+    consumer.sequence = sequence;
+    return true;
+}
+
+bool SharedVideoDecoder::nextFrame(Consumer &consumer, const VideoDecoder::Frame *&frame) {
+    if (!follows(consumer, NEXT_FRAME))
+        return false;
+    if (consumer.sequence == sequence) {
+        decoder->releaseFrame(latestFrame);
+        latestFrame = decoder->nextFrame();
+        advance(NEXT_FRAME);
+    }
+    consumer.sequence = sequence;
+    decoder->retainFrame(latestFrame);
+    frame = latestFrame;
+    return true;
+}
+
+bool SharedVideoDecoder::frameAt(Consumer &consumer, long long timestamp, const VideoDecoder::Frame *&frame) {
+    if (!(latestFrame && latestFrame->pts <= timestamp && timestamp < latestFrame->pts+latestFrame->duration)) {
+        // Seeking backwards would pull the other consumers away from their frames
+        if (consumerCount > 1 && latestFrame && timestamp < latestFrame->pts)
+            return false;
+        decoder->releaseFrame(latestFrame);
+        latestFrame = decoder->frameAt(timestamp);
+        advance(FRAME_AT);
+    }
+    consumer.sequence = sequence;
+    decoder->retainFrame(latestFrame);
+    frame = latestFrame;
+    return true;
+}
+
+bool SharedVideoDecoder::keyframeAt(Consumer &consumer, long long timestamp, const VideoDecoder::Frame *&frame) {
+    if (!(latestFrame && latestFrame->pts <= timestamp && timestamp < latestFrame->pts+latestFrame->duration)) {
+        // The keyframe may precede the other consumers' frames
+        if (consumerCount > 1)
+            return false;
+        decoder->releaseFrame(latestFrame);
+        latestFrame = decoder->keyframeAt(timestamp);
+        advance(KEYFRAME_AT);
+    }
+    consumer.sequence = sequence;
+    decoder->retainFrame(latestFrame);
+    frame = latestFrame;
+    return true;
+}
+
+void SharedVideoDecoder::attach(Consumer &consumer) {
+    // A consumer which joins in the middle of the video is not in lockstep with any other
+    consumer.sequence = atStart ? sequence : 0;
+    consumer.skipMode = VideoDecoder::SKIP_NONE;
+    ++skipModeConsumers[VideoDecoder::SKIP_NONE];
+    ++consumerCount;
+    updateSkipMode();
+}
+
+bool SharedVideoDecoder::follows(const Consumer &consumer, Operation operation) const {
+    // The consumer is either at the latest state, or one step behind another consumer which has just performed the same operation
+    if (consumer.sequence == sequence || (consumer.sequence+1 == sequence && lastOperation == operation))
+        return true;
+    // During playback, a consumer which has fallen behind by several frames skips to the latest one like the decoder would when catching up
+    return operation == NEXT_FRAME && lastOperation == NEXT_FRAME && consumer.sequence >= runStart;
+}
+
+void SharedVideoDecoder::advance(Operation operation) {
+    if (operation != lastOperation)
+        runStart = sequence;
+    ++sequence;
+    lastOperation = operation;
+    atStart = false;
+}
+
+void SharedVideoDecoder::updateSkipMode() {
+    // The least discarding mode requested by any consumer in lockstep applies
+    for (int i = 0; i <= VideoDecoder::SKIP_NONKEY; ++i) {
+        if (skipModeConsumers[i] > 0) {
+            if (i != skipMode) {
+                skipMode = (VideoDecoder::SkipMode) i;
+                decoder->setSkipMode(skipMode);
+            }
+            return;
+        }
+    }
+}
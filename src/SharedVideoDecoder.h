@@ -0,0 +1,87 @@
+
+#pragma once
+
+#include <string>
+#include <map>
+#include "VideoDecoder.h"
+
+/// A video decoder shared by several consumers of the same file. Consumers which move in lockstep receive the same frames from a single decode, the others have to diverge to a decoder of their own.
+class SharedVideoDecoder {
+
+public:
+    /// Position of a consumer in the sequence of operations on the shared decoder
+    struct Consumer {
+        unsigned long long sequence;
+        // Frames the consumer would have discarded to catch up, only those skipped by all consumers in lockstep are discarded
+        VideoDecoder::SkipMode skipMode;
+    };
+
+    /// Reference-counted shared decoders of open files
+    class Pool {
+
+    public:
+        Pool();
+        Pool(const Pool &) = delete;
+        ~Pool();
+        Pool & operator=(const Pool &) = delete;
+        /// Attaches consumer to a decoder of the file, opening it if necessary. Returns NULL if the file cannot be opened.
+        SharedVideoDecoder * acquire(const std::string &filename, VideoDecoder::ThreadingMode threading, int threadCount, Consumer &consumer);
+        void release(SharedVideoDecoder *decoder);
+
+    private:
+        std::multimap<std::string, SharedVideoDecoder *> decoders;
+
+    };
+
+    SharedVideoDecoder(const SharedVideoDecoder &) = delete;
+    SharedVideoDecoder & operator=(const SharedVideoDecoder &) = delete;
+    VideoDecoder * getDecoder();
+    /// Changes whether the video repeats for all consumers. Returns false if there are other consumers, which would be affected.
+    bool setRepeat(bool repeat);
+    /// Changes which frames the consumer would skip. The shared decoder discards only the frames skipped by every consumer in lockstep, so that a lagging consumer does not degrade the others.
+    void setSkipMode(Consumer &consumer, VideoDecoder::SkipMode mode);
+    /// Excludes the consumer's skip mode from the shared one once it diverges or is about to be released
+    void leaveLockstep(Consumer &consumer);
+    // The following return false if the consumer has diverged from the others, in which case the shared decoder is left untouched
+    /// Makes the shared decoder jump to the keyframe following timestamp, unless another consumer has already moved ahead of this one
+    void seekKeyframe(Consumer &consumer, long long timestamp);
+    bool rewind(Consumer &consumer);
+    /// Provides the frame following the consumer's previous one, or the latest frame if the consumer is several frames behind the others, which must be released to the decoder
+    bool nextFrame(Consumer &consumer, const VideoDecoder::Frame *&frame);
+    /// Provides the frame displayed at timestamp, which must be released to the decoder
+    bool frameAt(Consumer &consumer, long long timestamp, const VideoDecoder::Frame *&frame);
+    /// Provides the keyframe preceding timestamp, which must be released to the decoder
+    bool keyframeAt(Consumer &consumer, long long timestamp, const VideoDecoder::Frame *&frame);
+
+private:
+    enum Operation {
+        NONE,
+        REWIND,
+        NEXT_FRAME,
+        FRAME_AT,
+        KEYFRAME_AT
+    };
+
+    VideoDecoder *decoder;
+    VideoDecoder::ThreadingMode threading;
+    int threadCount;
+    int consumerCount;
+    const VideoDecoder::Frame *latestFrame;
+    unsigned long long sequence;
+    Operation lastOperation;
+    // Sequence number from which operations have been the same as the last one
+    unsigned long long runStart;
+    VideoDecoder::SkipMode skipMode;
+    // Number of consumers in lockstep by their skip mode
+    int skipModeConsumers[VideoDecoder::SKIP_NONKEY+1];
+    bool repeat;
+    bool atStart;
+
+    SharedVideoDecoder(VideoDecoder *decoder, VideoDecoder::ThreadingMode threading, int threadCount);
+    ~SharedVideoDecoder();
+    void attach(Consumer &consumer);
+    bool follows(const Consumer &consumer, Operation operation) const;
+    void advance(Operation operation);
+    void updateSkipMode();
+
+};
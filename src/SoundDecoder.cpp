@@ -4,27 +4,31 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <climits>
+#include <algorithm>
+#include <functional>
 extern "C" {
-    #include <libavutil/opt.h>
+    #include <libavutil/intreadwrite.h>
     #include <libavformat/avformat.h>
-    #include <libswresample/swresample.h>
 }
+#include "AudioDecoder.h"
+#include "WorkerPool.h"
 
-#define SAMPLE_SIZE 4
-#define BUFFER_SIZE 0x10000
+// Size of the I/O buffer, which only serves small reads of the demuxer since larger ones are copied directly into packets
+#define BUFFER_SIZE 0x4000
+// Estimated size of decoded samples above which the waveform is not stored in memory but decoded straight into the output
+#define STREAMING_THRESHOLD 0x4000000
+// Minimum number of samples per segment of a stream decoded in parallel
+#define MIN_SEGMENT_SAMPLES 0x40000
+// Number of samples per packet assumed for the seek margin ahead of a segment if the codec does not specify it
+#define SEEK_MARGIN 0x1000
+// Number of packets decoded ahead of an MPEG audio segment to fill the bit reservoir and the filter banks
+#define MPEG_AUDIO_PREROLL 10
+// Size of additional chunks of stored samples when the estimated length is exceeded or unknown
+#define CHUNK_SIZE 0x100000
 
-static void storeSamples(SwrContext *sc, AVFrame *frame, std::vector<unsigned char> &storage, int &sampleCount) {
-    int newSamples = frame->nb_samples;
-    if (newSamples > 0) {
-        int prevSize = (int) storage.size();
-        storage.resize(storage.size()+SAMPLE_SIZE*newSamples);
-        unsigned char *target[8] = { &storage[prevSize] };
-        swr_convert(sc, target, newSamples, const_cast<const uint8_t **>(frame->data), newSamples);
-        sampleCount += newSamples;
-    }
-}
-
-SoundDecoder * SoundDecoder::decode(const void *data, int length) {
+/// An audio stream of a file in memory, opened for decoding
+struct SoundDecoder::Stream {
     struct DataContext {
         const unsigned char *data;
         int pos, length;
@@ -39,7 +43,7 @@ SoundDecoder * SoundDecoder::decode(const void *data, int length) {
                 data->pos += chunk;
                 return chunk;
             }
-            return 0;
+            return AVERROR_EOF;
         }
         static int64_t seek(void *context, int64_t offset, int whence) {
             DataContext *data = reinterpret_cast<DataContext *>(context);
@@ -64,90 +68,420 @@ SoundDecoder * SoundDecoder::decode(const void *data, int length) {
             data->pos = (int) newPos;
             return 0;
         }
-    } dataContext = { reinterpret_cast<const unsigned char *>(data), 0, length };
+    } dataContext;
+    Format format;
+    AVFormatContext *fc;
+    int streamId;
+    AudioDecoder *decoder;
+    // Number of packets which must be decoded ahead of a segment, or -1 if the stream cannot be split
+    int preroll;
+    // Timestamps in samples at which the stream is split into independently decodable segments
+    std::vector<int64_t> segmentBounds;
 
-    SoundDecoder *output = NULL;
+    static Stream * open(const void *data, int length, const Format &format);
+
+    Stream(const Stream &) = delete;
+    ~Stream();
+    Stream & operator=(const Stream &) = delete;
+    int getSampleRate() const;
+    /// Estimated number of samples, or -1 if unknown
+    long long estimateSampleCount() const;
+    /// Counts the samples from the durations of packets, or takes the exact duration of the container, and decodes just the first frame for the timestamp of the first sample. Returns false if the packets do not specify their durations.
+    bool countSamples(long long &sampleCount, int64_t &firstSample);
+    /// Converts a timestamp of the stream to samples
+    int64_t sampleTimestamp(int64_t timestamp) const;
+    /// Splits the stream by time into at most maxSegments segments if the codec can decode them separately with identical results. Returns the number of segments.
+    int split(int maxSegments);
+    /// Decodes the whole stream, passing samples of each decoded frame to callback(segment, frame, decoder, offset, samples), which returns false to abort. Different segments are decoded concurrently by workers.
+    template <typename F>
+    bool decodeFrames(WorkerPool *workers, F callback);
+
+private:
+    Stream(const void *data, int length, const Format &format);
+    /// Seeks to the segment if it is not the first one and decodes it. Fails if the seek does not leave enough packets for the pre-roll or the timestamps are not contiguous.
+    template <typename F>
+    bool decodeSegment(int segment, F callback);
+
+};
+
+static bool isPcm(AVCodecID codecId) {
+    return codecId >= AV_CODEC_ID_FIRST_AUDIO && codecId < AV_CODEC_ID_ADPCM_IMA_QT;
+}
+
+/// Returns the number of packets which must be decoded ahead of a segment of the codec, or -1 if its streams cannot be split
+static int segmentPreroll(AVCodecID codecId) {
+    if (isPcm(codecId))
+        return 0;
+    switch (codecId) {
+        case AV_CODEC_ID_FLAC:
+        case AV_CODEC_ID_ALAC:
+            return 0;
+        case AV_CODEC_ID_MP1:
+        case AV_CODEC_ID_MP2:
+        case AV_CODEC_ID_MP3:
+            return MPEG_AUDIO_PREROLL;
+        default:
+            return -1;
+    }
+}
+
+static AVSampleFormat avSampleFormat(SoundDecoder::SampleType sampleType) {
+    switch (sampleType) {
+        case SoundDecoder::INT16:
+            return AV_SAMPLE_FMT_S16;
+        case SoundDecoder::INT32:
+            return AV_SAMPLE_FMT_S32;
+        case SoundDecoder::FLOAT32:
+            return AV_SAMPLE_FMT_FLT;
+    }
+    return AV_SAMPLE_FMT_NONE;
+}
+
+/// Identifies the output format in keys of the sample cache
+static uint32_t cacheFormat(const SoundDecoder::Format &format) {
+    return (uint32_t) format.sampleType<<16|(uint32_t) format.channels<<8|(uint32_t) av_get_bytes_per_sample(avSampleFormat(format.sampleType))<<3;
+}
+
+SoundDecoder::Stream * SoundDecoder::Stream::open(const void *data, int length, const Format &format) {
+    Stream *stream = new Stream(data, length, format);
     AVFormatContext *fc = avformat_alloc_context();
     if (fc) {
-        void *buffer = av_malloc(BUFFER_SIZE);
-        AVIOContext *ioc = avio_alloc_context(reinterpret_cast<unsigned char *>(buffer), BUFFER_SIZE, 0, &dataContext, &DataContext::read, NULL, &DataContext::seek);
+        int bufferSize = length < BUFFER_SIZE ? length+AV_INPUT_BUFFER_PADDING_SIZE : BUFFER_SIZE;
+        void *buffer = av_malloc(bufferSize);
+        AVIOContext *ioc = buffer ? avio_alloc_context(reinterpret_cast<unsigned char *>(buffer), bufferSize, 0, &stream->dataContext, &DataContext::read, NULL, &DataContext::seek) : NULL;
         if (ioc) {
+            // Reads and seeks go straight to the data in memory instead of being buffered twice
+            ioc->direct = 1;
             fc->pb = ioc;
             if (avformat_open_input(&fc, "", NULL, NULL) >= 0) {
+                stream->fc = fc;
                 if (avformat_find_stream_info(fc, NULL) >= 0) {
-                    AVCodec *decoder = NULL;
-                    int streamId = av_find_best_stream(fc, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder, 0);
-                    if (streamId >= 0 && decoder) {
-                        AVCodecContext *cc = avcodec_alloc_context3(decoder);
-                        if (cc) {
-                            const AVCodecParameters *codecpar = fc->streams[streamId]->codecpar;
-                            if (avcodec_parameters_to_context(cc, codecpar) >= 0) {
-                                AVDictionary *options = NULL;
-                                if (avcodec_open2(cc, decoder, &options) >= 0) {
-                                    SwrContext *sc = swr_alloc();
-                                    if (sc) {
-                                        av_opt_set_int(sc, "in_channel_layout", cc->channel_layout, 0);
-                                        av_opt_set_int(sc, "in_sample_rate", cc->sample_rate, 0);
-                                        av_opt_set_int(sc, "in_sample_fmt", cc->sample_fmt, 0);
-                                        av_opt_set_int(sc, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-                                        av_opt_set_int(sc, "out_sample_rate", cc->sample_rate, 0);
-                                        av_opt_set_int(sc, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-                                        if (swr_init(sc) >= 0) {
-                                            AVFrame *frame = av_frame_alloc();
-                                            if (frame) {
-                                                bool ok = true;
-                                                int sampleRate = cc->sample_rate;
-                                                int sampleCount = 0;
-                                                std::vector<unsigned char> sampleBuffer;
-                                                AVPacket pkt = { };
-                                                av_init_packet(&pkt);
-                                                while (av_read_frame(fc, &pkt) == 0) {
-                                                    if (pkt.stream_index == streamId) {
-                                                        if (avcodec_send_packet(cc, &pkt) < 0) {
-                                                            av_packet_unref(&pkt);
-                                                            ok = false;
-                                                            break;
-                                                        }
-                                                        while (!avcodec_receive_frame(cc, frame)) {
-                                                            storeSamples(sc, frame, sampleBuffer, sampleCount);
-                                                        }
-                                                    }
-                                                    av_packet_unref(&pkt);
-                                                }
-                                                if (ok) {
-                                                    if (avcodec_send_packet(cc, NULL) >= 0) {
-                                                        while (!avcodec_receive_frame(cc, frame)) {
-                                                            storeSamples(sc, frame, sampleBuffer, sampleCount);
-                                                        }
-                                                        output = new SoundDecoder(sampleRate, sampleCount, (std::vector<unsigned char> &&) sampleBuffer);
-                                                    }
-                                                }
-                                                av_frame_free(&frame);
-                                            }
-                                        }
-                                        swr_free(&sc);
-                                    }
-                                    avcodec_close(cc);
-                                }
-                            }
-                            avcodec_free_context(&cc);
+                    int streamId = av_find_best_stream(fc, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+                    if (streamId >= 0) {
+                        stream->streamId = streamId;
+                        stream->preroll = segmentPreroll(fc->streams[streamId]->codecpar->codec_id);
+                        if ((stream->decoder = AudioDecoder::open(fc->streams[streamId]->codecpar, avSampleFormat(format.sampleType), format.channels))) {
+                            // Lets the decoder shift the timestamps of frames it trims, which segments are aligned by
+                            stream->decoder->cc->pkt_timebase = fc->streams[streamId]->time_base;
+                            return stream;
                         }
                     }
                 }
-                avformat_close_input(&fc);
-            } else
+            } else {
+                av_freep(&ioc->buffer);
                 av_free(ioc);
+            }
         } else
             av_free(buffer);
-        if (fc)
+        if (!stream->fc)
             avformat_free_context(fc);
     }
+    delete stream;
+    return NULL;
+}
+
+SoundDecoder::Stream::Stream(const void *data, int length, const Format &format) : format(format), fc(NULL), streamId(-1), decoder(NULL), preroll(-1) {
+    segmentBounds.push_back(INT64_MIN);
+    segmentBounds.push_back(INT64_MAX);
+    dataContext.data = reinterpret_cast<const unsigned char *>(data);
+    dataContext.pos = 0;
+    dataContext.length = length;
+}
+
+SoundDecoder::Stream::~Stream() {
+    delete decoder;
+    if (fc) {
+        AVIOContext *ioc = fc->pb;
+        avformat_close_input(&fc);
+        if (ioc) {
+            av_freep(&ioc->buffer);
+            av_free(ioc);
+        }
+    }
+}
+
+int SoundDecoder::Stream::getSampleRate() const {
+    return decoder->cc->sample_rate;
+}
+
+long long SoundDecoder::Stream::estimateSampleCount() const {
+    const AVStream *avStream = fc->streams[streamId];
+    int sampleRate = getSampleRate();
+    if (sampleRate <= 0)
+        return -1;
+    if (avStream->duration > 0 && avStream->duration != AV_NOPTS_VALUE)
+        return av_rescale_q(avStream->duration, avStream->time_base, av_make_q(1, sampleRate));
+    if (avStream->nb_frames > 0 && avStream->codecpar->frame_size > 0)
+        return avStream->nb_frames*avStream->codecpar->frame_size;
+    if (fc->duration > 0 && fc->duration != AV_NOPTS_VALUE)
+        return av_rescale(fc->duration, sampleRate, AV_TIME_BASE);
+    return -1;
+}
+
+bool SoundDecoder::Stream::countSamples(long long &sampleCount, int64_t &firstSample) {
+    const AVStream *avStream = fc->streams[streamId];
+    AVRational sampleTimeBase = av_make_q(1, getSampleRate());
+    // The container's duration of PCM and FLAC streams is exact, so only the first frame is needed
+    bool exactDuration = (isPcm(avStream->codecpar->codec_id) || avStream->codecpar->codec_id == AV_CODEC_ID_FLAC) && avStream->duration > 0 && avStream->duration != AV_NOPTS_VALUE;
+    sampleCount = 0;
+    firstSample = AV_NOPTS_VALUE;
+    bool ok = true;
+    AVPacket pkt = { };
+    av_init_packet(&pkt);
+    while (ok && !(exactDuration && firstSample != AV_NOPTS_VALUE) && av_read_frame(fc, &pkt) == 0) {
+        if (pkt.stream_index == streamId) {
+            if (firstSample == AV_NOPTS_VALUE) {
+                ok = avcodec_send_packet(decoder->cc, &pkt) >= 0 && decoder->receiveFrames([&](AVFrame *frame) {
+                    if (firstSample == AV_NOPTS_VALUE)
+                        firstSample = frame->best_effort_timestamp != AV_NOPTS_VALUE ? sampleTimestamp(frame->best_effort_timestamp) : 0;
+                    return true;
+                });
+            }
+            int duration = pkt.duration > 0 ? (int) av_rescale_q(pkt.duration, avStream->time_base, sampleTimeBase) : av_get_audio_frame_duration2(avStream->codecpar, pkt.size);
+            ok = ok && duration > 0;
+            // Samples the decoder skips at the start or discards at the end are not output
+            int skipSize = 0;
+            if (const uint8_t *skip = av_packet_get_side_data(&pkt, AV_PKT_DATA_SKIP_SAMPLES, &skipSize)) {
+                if (skipSize >= 8)
+                    duration -= (int) (AV_RL32(skip)+AV_RL32(skip+4));
+            }
+            sampleCount += duration > 0 ? duration : 0;
+        }
+        av_packet_unref(&pkt);
+    }
+    if (exactDuration)
+        sampleCount = av_rescale_q(avStream->duration, avStream->time_base, sampleTimeBase);
+    return ok && firstSample != AV_NOPTS_VALUE;
+}
+
+int SoundDecoder::Stream::split(int maxSegments) {
+    const AVStream *avStream = fc->streams[streamId];
+    long long length = estimateSampleCount();
+    int segments = 1;
+    if (preroll >= 0 && length > 0 && maxSegments > 1)
+        segments = (int) std::min<long long>(maxSegments, length/MIN_SEGMENT_SAMPLES);
+    if (segments < 1)
+        segments = 1;
+    int64_t start = avStream->start_time != AV_NOPTS_VALUE ? sampleTimestamp(avStream->start_time) : 0;
+    segmentBounds.resize(segments+1);
+    segmentBounds[0] = INT64_MIN;
+    for (int i = 1; i < segments; ++i)
+        segmentBounds[i] = start+length*i/segments;
+    segmentBounds[segments] = INT64_MAX;
+    return segments;
+}
+
+int64_t SoundDecoder::Stream::sampleTimestamp(int64_t timestamp) const {
+    return av_rescale_q(timestamp, fc->streams[streamId]->time_base, av_make_q(1, getSampleRate()));
+}
+
+template <typename F>
+bool SoundDecoder::Stream::decodeSegment(int segment, F callback) {
+    const AVStream *avStream = fc->streams[streamId];
+    AVCodecContext *cc = decoder->cc;
+    int64_t begin = segmentBounds[segment], end = segmentBounds[segment+1];
+    bool split = segmentBounds.size() > 2;
+    int64_t streamStart = avStream->start_time != AV_NOPTS_VALUE ? sampleTimestamp(avStream->start_time) : 0;
+    if (segment > 0) {
+        // The seek goes ahead of the segment by a margin for the pre-roll and inexact seeking, surplus samples are discarded
+        int frameSize = avStream->codecpar->frame_size > 0 ? avStream->codecpar->frame_size : SEEK_MARGIN;
+        int64_t target = av_rescale_q(begin-2LL*(preroll+1)*frameSize, av_make_q(1, getSampleRate()), avStream->time_base);
+        if (avformat_seek_file(fc, streamId, INT64_MIN, target, target, 0) < 0)
+            return false;
+    }
+    bool started = segment == 0;
+    int prerollPackets = 0;
+    int64_t firstPts = AV_NOPTS_VALUE, prevPts = AV_NOPTS_VALUE, nextSample = AV_NOPTS_VALUE;
+    // The packet with the first sample of the segment must be preceded by the pre-roll, unless the seek went to the start of the stream
+    auto prerolled = [&]() -> bool {
+        return prerollPackets > preroll || (prerollPackets > 0 && firstPts <= streamStart);
+    };
+    auto receive = [&](AVFrame *frame) -> bool {
+        if (!split)
+            return callback(segment, frame, decoder, 0, frame->nb_samples);
+        if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+            return false;
+        int64_t frameStart = sampleTimestamp(frame->best_effort_timestamp);
+        int64_t frameEnd = frameStart+frame->nb_samples;
+        if (frameEnd <= begin || frameStart >= end)
+            return true;
+        // The samples must be contiguous for the segments to add up to the same waveform as when decoded serially
+        if (nextSample == AV_NOPTS_VALUE ? segment > 0 && frameStart > begin : frameStart != nextSample)
+            return false;
+        nextSample = frameEnd;
+        int offset = frameStart < begin ? (int) (begin-frameStart) : 0;
+        return callback(segment, frame, decoder, offset, (int) (std::min(frameEnd, end)-frameStart)-offset);
+    };
+    bool ok = true;
+    AVPacket pkt = { };
+    av_init_packet(&pkt);
+    while (ok && av_read_frame(fc, &pkt) == 0) {
+        if (pkt.stream_index == streamId) {
+            if (split) {
+                // Segments are told apart by the timestamps of packets, which must therefore be increasing
+                int64_t pts = pkt.pts != AV_NOPTS_VALUE ? sampleTimestamp(pkt.pts) : AV_NOPTS_VALUE;
+                if (pts == AV_NOPTS_VALUE || (prevPts != AV_NOPTS_VALUE && pts <= prevPts)) {
+                    av_packet_unref(&pkt);
+                    return false;
+                }
+                if (pts >= end) {
+                    av_packet_unref(&pkt);
+                    break;
+                }
+                if (firstPts == AV_NOPTS_VALUE)
+                    firstPts = pts;
+                prevPts = pts;
+                if (!started) {
+                    if (pts > begin) {
+                        if (!prerolled()) {
+                            av_packet_unref(&pkt);
+                            return false;
+                        }
+                        started = true;
+                    } else
+                        ++prerollPackets;
+                }
+            }
+            // Packets of the pre-roll may fail to decode on their own, their frames are discarded anyway
+            ok = (avcodec_send_packet(cc, &pkt) >= 0 || !started) && decoder->receiveFrames(receive);
+        }
+        av_packet_unref(&pkt);
+    }
+    return ok && (started || prerolled()) && avcodec_send_packet(cc, NULL) >= 0 && decoder->receiveFrames(receive);
+}
+
+template <typename F>
+bool SoundDecoder::Stream::decodeFrames(WorkerPool *workers, F callback) {
+    int segments = (int) segmentBounds.size()-1;
+    if (segments == 1)
+        return decodeSegment(0, callback);
+    std::vector<char> results(segments, 0);
+    std::function<void(int)> job = [&](int segment) {
+        if (segment == 0) {
+            results[0] = decodeSegment(0, callback);
+            return;
+        }
+        // Other segments are read by their own demuxers from the same data
+        if (Stream *stream = open(dataContext.data, dataContext.length, format)) {
+            stream->segmentBounds = segmentBounds;
+            results[segment] = stream->decodeSegment(segment, callback);
+            delete stream;
+        }
+    };
+    if (workers)
+        workers->run(segments, job);
+    else {
+        for (int i = 0; i < segments; ++i)
+            job(i);
+    }
+    return std::find(results.begin(), results.end(), 0) == results.end();
+}
+
+SoundDecoder::Format::Format(SampleType sampleType, int channels) : sampleType(sampleType), channels(channels) { }
+
+int SoundDecoder::Format::sampleSize() const {
+    return channels*av_get_bytes_per_sample(avSampleFormat(sampleType));
+}
+
+bool SoundDecoder::Format::operator==(const Format &other) const {
+    return sampleType == other.sampleType && channels == other.channels;
+}
+
+SoundDecoder * SoundDecoder::decode(const void *data, int length, const Format &format, WorkerPool *workers, SampleCache::Writer *cacheWriter) {
+    if (!AudioDecoder::channelLayout(format.channels) || avSampleFormat(format.sampleType) == AV_SAMPLE_FMT_NONE)
+        return NULL;
+    SampleCache::Key cacheKey = SampleCache::key(data, length, cacheFormat(format));
+    int sampleRate, sampleCount;
+    if (SampleCache::find(cacheKey, sampleRate, sampleCount))
+        return new SoundDecoder(format, sampleRate, sampleCount, CACHED, cacheKey, std::vector<std::vector<unsigned char> >());
+    return decodeData(data, length, format, cacheKey, workers, cacheWriter);
+}
+
+SoundDecoder * SoundDecoder::decodeData(const void *data, int length, const Format &format, const SampleCache::Key &cacheKey, WorkerPool *workers, SampleCache::Writer *cacheWriter) {
+    SoundDecoder *output = NULL;
+    int sampleSize = format.sampleSize();
+    int segments = 1;
+    if (Stream *stream = Stream::open(data, length, format)) {
+        int sampleRate = stream->getSampleRate();
+        long long estimate = stream->estimateSampleCount();
+        if (estimate > STREAMING_THRESHOLD/sampleSize) {
+            // The samples are decoded straight into the output buffer in fetchWaveform, here they are only counted
+            long long count = 0;
+            int64_t firstSample = AV_NOPTS_VALUE;
+            bool counted = stream->countSamples(count, firstSample);
+            if (!counted) {
+                // If the packets do not specify their durations, the stream has to be decoded to count them
+                delete stream;
+                count = 0;
+                firstSample = AV_NOPTS_VALUE;
+                if ((stream = Stream::open(data, length, format))) {
+                    counted = stream->decodeFrames(NULL, [&](int segment, AVFrame *frame, AudioDecoder *decoder, int offset, int samples) {
+                        if (firstSample == AV_NOPTS_VALUE)
+                            firstSample = frame->best_effort_timestamp != AV_NOPTS_VALUE ? stream->sampleTimestamp(frame->best_effort_timestamp)+offset : 0;
+                        count += samples;
+                        return true;
+                    });
+                }
+            }
+            if (counted && count <= INT_MAX) {
+                output = new SoundDecoder(format, sampleRate, (int) count, STREAMING, cacheKey, std::vector<std::vector<unsigned char> >());
+                output->firstSample = firstSample;
+            }
+        } else {
+            segments = stream->split(workers ? workers->getThreadCount() : 1);
+            std::vector<int> segmentSampleCounts(segments, 0);
+            // Samples are stored in chunks reserved in advance so that they are never reallocated
+            std::vector<std::vector<std::vector<unsigned char> > > segmentChunks(segments);
+            if (estimate > 0) {
+                for (int i = 0; i < segments; ++i) {
+                    segmentChunks[i].push_back(std::vector<unsigned char>());
+                    segmentChunks[i].back().reserve((size_t) sampleSize*(estimate/segments));
+                }
+            }
+            if (stream->decodeFrames(workers, [&](int segment, AVFrame *frame, AudioDecoder *decoder, int offset, int samples) {
+                std::vector<std::vector<unsigned char> > &sampleChunks = segmentChunks[segment];
+                size_t frameSize = (size_t) sampleSize*samples;
+                if (sampleChunks.empty() || sampleChunks.back().capacity()-sampleChunks.back().size() < frameSize) {
+                    sampleChunks.push_back(std::vector<unsigned char>());
+                    sampleChunks.back().reserve(frameSize > CHUNK_SIZE ? frameSize : CHUNK_SIZE);
+                }
+                std::vector<unsigned char> &chunk = sampleChunks.back();
+                size_t prevSize = chunk.size();
+                chunk.resize(prevSize+frameSize);
+                segmentSampleCounts[segment] += samples;
+                return decoder->convert(&chunk[prevSize], frame, offset, samples);
+            })) {
+                int sampleCount = 0;
+                std::vector<std::vector<unsigned char> > sampleChunks;
+                for (int i = 0; i < segments; ++i) {
+                    sampleCount += segmentSampleCounts[i];
+                    for (std::vector<std::vector<unsigned char> >::iterator it = segmentChunks[i].begin(); it != segmentChunks[i].end(); ++it)
+                        sampleChunks.push_back((std::vector<unsigned char> &&) *it);
+                }
+                output = new SoundDecoder(format, sampleRate, sampleCount, BUFFERED, cacheKey, (std::vector<std::vector<unsigned char> > &&) sampleChunks);
+            }
+        }
+        if (output) {
+            output->cacheable = !isPcm(stream->fc->streams[stream->streamId]->codecpar->codec_id);
+            output->cacheWriter = cacheWriter;
+            // With a writer, the stored samples are handed over to it once they have been fetched
+            if (output->mode == BUFFERED && output->cacheable && !cacheWriter)
+                SampleCache::store(cacheKey, output->sampleRate, output->sampleCount, output->sampleChunks);
+        }
+        delete stream;
+    }
+    // A stream whose segments turn out not to be decodable separately, e.g. because of irregular timestamps, is decoded again serially
+    if (!output && segments > 1)
+        return decodeData(data, length, format, cacheKey, NULL, cacheWriter);
     return output;
 }
 
-SoundDecoder::SoundDecoder(int sampleRate, int sampleCount, std::vector<unsigned char> &&sampleBuffer) : sampleRate(sampleRate), sampleCount(sampleCount), sampleBuffer((std::vector<unsigned char> &&) sampleBuffer) { }
+SoundDecoder::SoundDecoder(const Format &format, int sampleRate, int sampleCount, Mode mode, const SampleCache::Key &cacheKey, std::vector<std::vector<unsigned char> > &&sampleChunks) : format(format), sampleRate(sampleRate), sampleCount(sampleCount), mode(mode), cacheKey(cacheKey), sampleChunks((std::vector<std::vector<unsigned char> > &&) sampleChunks), firstSample(0), cacheable(false), cacheWriter(NULL) { }
 
-SoundDecoder::~SoundDecoder() { }
+SoundDecoder::~SoundDecoder() {
+    if (mode == BUFFERED && cacheable && cacheWriter)
+        cacheWriter->store(cacheKey, sampleRate, sampleCount, (std::vector<std::vector<unsigned char> > &&) sampleChunks);
+}
 
 int SoundDecoder::getSampleRate() const {
     return sampleRate;
@@ -157,14 +491,78 @@ int SoundDecoder::getSampleCount() const {
     return sampleCount;
 }
 
-void SoundDecoder::copyWaveform(void *output, int samples) const {
+const SoundDecoder::Format & SoundDecoder::getFormat() const {
+    return format;
+}
+
+bool SoundDecoder::fetchWaveform(const void *data, int length, void *output, int samples, WorkerPool *workers) const {
     if (samples <= 0)
-        return;
-    size_t dataSize = SAMPLE_SIZE*samples;
-    if (dataSize > sampleBuffer.size()) {
-        if (sampleBuffer.size() > 0)
-            memcpy(output, &sampleBuffer[0], sampleBuffer.size());
-        memset(reinterpret_cast<unsigned char *>(output)+sampleBuffer.size(), 0, dataSize-sampleBuffer.size());
-    } else
-        memcpy(output, &sampleBuffer[0], dataSize);
+        return true;
+    unsigned char *target = reinterpret_cast<unsigned char *>(output);
+    int sampleSize = format.sampleSize();
+    size_t dataSize = (size_t) sampleSize*samples;
+    size_t written = 0;
+    if (mode == CACHED) {
+        if (SampleCache::read(cacheKey, output, samples, sampleSize))
+            return true;
+        // The cache file has been removed or damaged in the meantime
+        SoundDecoder *decoder = decodeData(data, length, format, cacheKey, workers, cacheWriter);
+        bool ok = decoder && decoder->fetchWaveform(data, length, output, samples, workers);
+        delete decoder;
+        return ok;
+    }
+    if (mode == STREAMING) {
+        // A stream whose segments turn out not to be decodable separately is decoded again serially
+        if (!streamWaveform(data, length, target, samples, workers) && !(workers && streamWaveform(data, length, target, samples, NULL)))
+            return false;
+        written = dataSize;
+        if (samples >= sampleCount && cacheable) {
+            if (cacheWriter)
+                cacheWriter->store(cacheKey, sampleRate, sampleCount, output, (size_t) sampleSize*sampleCount);
+            else
+                SampleCache::store(cacheKey, sampleRate, sampleCount, output, (size_t) sampleSize*sampleCount);
+        }
+    } else {
+        for (std::vector<std::vector<unsigned char> >::const_iterator it = sampleChunks.begin(); it != sampleChunks.end() && written < dataSize; ++it) {
+            size_t chunkSize = it->size() < dataSize-written ? it->size() : dataSize-written;
+            if (chunkSize > 0)
+                memcpy(target+written, &(*it)[0], chunkSize);
+            written += chunkSize;
+        }
+    }
+    if (written < dataSize)
+        memset(target+written, 0, dataSize-written);
+    return true;
+}
+
+bool SoundDecoder::streamWaveform(const void *data, int length, unsigned char *output, int samples, WorkerPool *workers) const {
+    Stream *stream = Stream::open(data, length, format);
+    if (!stream)
+        return false;
+    int segments = stream->split(workers ? workers->getThreadCount() : 1);
+    int sampleSize = format.sampleSize();
+    // Each segment is written from the position of its first sample relative to the first sample of the stream up to the start of the next one
+    std::vector<int> segmentStarts(segments+1, samples);
+    segmentStarts[0] = 0;
+    for (int i = 1; i < segments; ++i)
+        segmentStarts[i] = (int) std::max<int64_t>(segmentStarts[i-1], std::min<int64_t>(stream->segmentBounds[i]-firstSample, samples));
+    std::vector<int> segmentEnds(segmentStarts.begin(), segmentStarts.end()-1);
+    bool ok = stream->decodeFrames(workers, [&](int segment, AVFrame *frame, AudioDecoder *decoder, int offset, int frameSamples) {
+        int newSamples = std::min(segmentStarts[segment+1]-segmentEnds[segment], frameSamples);
+        if (newSamples > 0) {
+            if (!decoder->convert(output+(size_t) sampleSize*segmentEnds[segment], frame, offset, newSamples))
+                return false;
+            segmentEnds[segment] += newSamples;
+        }
+        return true;
+    });
+    delete stream;
+    if (!ok)
+        return false;
+    // Any samples missing at the end of a segment, or beyond the end of the stream, are silent
+    for (int i = 0; i < segments; ++i) {
+        if (segmentEnds[i] < segmentStarts[i+1])
+            memset(output+(size_t) sampleSize*segmentEnds[i], 0, (size_t) sampleSize*(segmentStarts[i+1]-segmentEnds[i]));
+    }
+    return true;
 }
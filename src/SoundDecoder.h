@@ -2,25 +2,71 @@
 #pragma once
 
 #include <vector>
+#include "SampleCache.h"
+
+class WorkerPool;
 
 /// Sound file decoder
 class SoundDecoder {
 
 public:
-    static SoundDecoder * decode(const void *data, int length);
+    enum SampleType {
+        INT16,
+        INT32,
+        FLOAT32
+    };
+
+    /// Output sample format with interleaved channels. Supported channel counts are 1 (mono), 2 (stereo), and 6 (5.1).
+    struct Format {
+        SampleType sampleType;
+        int channels;
+
+        explicit Format(SampleType sampleType = INT16, int channels = 2);
+        /// Size of one sample of all channels in bytes
+        int sampleSize() const;
+        bool operator==(const Format &other) const;
+    };
+
+    /// Decodes the sound file in data. If workers are given, long streams are split into segments decoded in parallel. If cacheWriter is given, decoded samples are stored in the sample cache in the background.
+    static SoundDecoder * decode(const void *data, int length, const Format &format = Format(), WorkerPool *workers = NULL, SampleCache::Writer *cacheWriter = NULL);
 
     SoundDecoder(const SoundDecoder &) = delete;
     virtual ~SoundDecoder();
     SoundDecoder & operator=(const SoundDecoder &) = delete;
     int getSampleRate() const;
     int getSampleCount() const;
-    void copyWaveform(void *output, int samples) const;
+    const Format & getFormat() const;
+    /// Writes the waveform into output, padded with silence. Data must be the same as the data the decoder was created from.
+    bool fetchWaveform(const void *data, int length, void *output, int samples, WorkerPool *workers = NULL) const;
 
 private:
+    struct Stream;
+
+    enum Mode {
+        BUFFERED,
+        // Samples are not stored but decoded again straight into the output
+        STREAMING,
+        // Samples are read from the persistent cache
+        CACHED
+    };
+
+    Format format;
     int sampleRate;
     int sampleCount;
-    std::vector<unsigned char> sampleBuffer;
+    Mode mode;
+    SampleCache::Key cacheKey;
+    // Consecutive chunks of stored samples, normally just one if the length of the stream is known in advance
+    std::vector<std::vector<unsigned char> > sampleChunks;
+    // Timestamp of the first sample in streaming mode, which the positions of segments decoded in parallel are relative to
+    int64_t firstSample;
+    // Whether the samples are worth storing in the cache, which they are not if the file is uncompressed
+    bool cacheable;
+    SampleCache::Writer *cacheWriter;
+
+    static SoundDecoder * decodeData(const void *data, int length, const Format &format, const SampleCache::Key &cacheKey, WorkerPool *workers, SampleCache::Writer *cacheWriter);
 
-    SoundDecoder(int sampleRate, int sampleCount, std::vector<unsigned char> &&sampleBuffer);
+    SoundDecoder(const Format &format, int sampleRate, int sampleCount, Mode mode, const SampleCache::Key &cacheKey, std::vector<std::vector<unsigned char> > &&sampleChunks);
+    /// Decodes the stream once straight into output in streaming mode
+    bool streamWaveform(const void *data, int length, unsigned char *output, int samples, WorkerPool *workers) const;
 
 };
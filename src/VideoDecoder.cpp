@@ -0,0 +1,859 @@
+
+#include "VideoDecoder.h"
+
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+extern "C" {
+    #include <libavutil/imgutils.h>
+    #include <libavformat/avformat.h>
+    #include <libswscale/swscale.h>
+}
+#include "colorConversion.h"
+
+// Maximum number of frames decoded ahead of the one held by the consumer
+#define FRAME_QUEUE_LENGTH 3
+// Total number of frame buffers, including the one held by the consumer and one leased to the host
+#define FRAME_POOL_SIZE (FRAME_QUEUE_LENGTH+2)
+// Maximum number of frame buffers which may be added for additional consumers
+#define MAX_EXTRA_FRAMES 8
+// Jumping forward by more than this many seconds triggers a seek even if no keyframe in between is known
+#define SEEK_DISTANCE 2.0
+// Memory shared by the frame caches of all decoders, which serve repeated clips that fit into it entirely without decoding
+#define FRAME_CACHE_BUDGET 0x40000000
+// Number of frames at the start of the video which are kept in the frame cache regardless of its budget, so that a standby decoder can take over after them when looping
+#define LOOP_PRIMED_FRAMES 8
+// Upper limit of automatically selected decoding threads, since each additional frame thread delays the output by one frame
+#define MAX_AUTO_THREADS 8
+
+/// A converted frame kept in the frame cache
+struct CachedFrame {
+    void *pixels;
+    long long duration;
+    // Frames at the start of the video are never evicted
+    bool pinned;
+    std::list<long long>::iterator lruPosition;
+};
+
+// Part of FRAME_CACHE_BUDGET reserved by existing decoders
+static std::mutex frameCacheBudgetMutex;
+static size_t frameCacheBudgetUsed = 0;
+
+struct VideoDecoder::VideoDecoderData {
+    std::string filename;
+    VideoDecoder::ThreadingMode threading;
+    int threadCount;
+    AVFrame *frame;
+    AVFormatContext *fc;
+    AVCodecContext *cc;
+    int streamId;
+    AVRational timeBase;
+    long long startTime;
+    long long frameDuration;
+    long long seekDistance;
+    SwsContext *sc;
+    // Color matrix and range the swscale fallback has been set up for, which follow the tags of the frames like the SIMD conversion
+    YuvMatrix scMatrix;
+    bool scFullRange;
+    bool scColorspaceSet;
+    int width, height;
+    int linesize;
+    // Slots of the frame buffers, unused ones have no pixels
+    Frame frames[FRAME_POOL_SIZE+MAX_EXTRA_FRAMES];
+    int references[FRAME_POOL_SIZE+MAX_EXTRA_FRAMES];
+    int frameCount;
+    // Number of buffers to be freed as soon as they are no longer in use
+    int excessFrames;
+    std::vector<Frame *> freeFrames;
+    std::deque<Frame *> readyFrames;
+    std::mutex mutex;
+    std::condition_variable decodeCondition;
+    std::condition_variable readyCondition;
+    std::vector<long long> keyframes;
+    unsigned generation;
+    long long skipUntil;
+    long long position;
+    bool repeat;
+    bool keyframeSeek;
+    bool keyframeSeekForward;
+    VideoDecoder::SkipMode skipMode;
+    bool finished;
+    bool stopRequested;
+    bool atStart;
+    // Timestamp of the next frame the codec will output, which differs from the position after a seek request or frames taken from the cache
+    long long codecPosition;
+    bool reachedEnd;
+    long long streamEnd;
+    // Number of frames decoded in sequence from the start of the video, until the first LOOP_PRIMED_FRAMES are pinned in the cache and primedEnd is known
+    int startFrames;
+    long long primedEnd;
+    // A second decoder of the same file, positioned after the pinned frames so that the main one may be swapped for it when playback returns to the start
+    AVFormatContext *standbyFc;
+    AVCodecContext *standbyCc;
+    AVFrame *standbyFrame;
+    bool standbyPrimed;
+    bool standbyRewound;
+    bool standbyFailed;
+    // Converted frames by timestamp, evicted in least recently used order. Frames are only cached while repeating a clip which fits into the reserved part of the shared budget.
+    std::map<long long, CachedFrame> frameCache;
+    std::list<long long> frameCacheLru;
+    size_t frameCacheSize;
+    size_t frameCacheReserved;
+    // Value of repeat the frame cache has been set up for
+    bool frameCacheRepeat;
+    std::thread thread;
+};
+
+static void setThreading(AVCodecContext *cc, VideoDecoder::ThreadingMode threading, int threadCount) {
+    if (threadCount <= 0) {
+        threadCount = (int) std::thread::hardware_concurrency();
+        if (threadCount > MAX_AUTO_THREADS)
+            threadCount = MAX_AUTO_THREADS;
+    }
+    switch (threading) {
+        case VideoDecoder::AUTO:
+            cc->thread_type = FF_THREAD_FRAME|FF_THREAD_SLICE;
+            break;
+        case VideoDecoder::SINGLE:
+            threadCount = 1;
+            break;
+        case VideoDecoder::FRAME:
+            cc->thread_type = FF_THREAD_FRAME;
+            break;
+        case VideoDecoder::SLICE:
+            cc->thread_type = FF_THREAD_SLICE;
+            break;
+    }
+    cc->thread_count = threadCount;
+}
+
+VideoDecoder * VideoDecoder::open(const char *filename, ThreadingMode threading, int threadCount) {
+    AVFormatContext *fc = NULL;
+    if (avformat_open_input(&fc, filename, NULL, NULL) >= 0) {
+        if (avformat_find_stream_info(fc, NULL) >= 0) {
+            AVCodec *decoder = NULL;
+            int streamId = av_find_best_stream(fc, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+            if (streamId >= 0 && decoder) {
+                AVCodecContext *cc = avcodec_alloc_context3(decoder);
+                if (cc) {
+                    const AVCodecParameters *codecpar = fc->streams[streamId]->codecpar;
+                    if (avcodec_parameters_to_context(cc, codecpar) >= 0) {
+                        setThreading(cc, threading, threadCount);
+                        AVDictionary *options = NULL;
+                        if (avcodec_open2(cc, decoder, &options) >= 0) {
+                            SwsContext *sc = sws_getContext(cc->width, cc->height, cc->pix_fmt, cc->width, cc->height, AV_PIX_FMT_RGBA, 0, NULL, NULL, NULL);
+                            if (sc) {
+                                AVFrame *frame = av_frame_alloc();
+                                if (frame) {
+                                    VideoDecoderData *data = new VideoDecoderData;
+                                    for (int i = 0; i < FRAME_POOL_SIZE+MAX_EXTRA_FRAMES; ++i)
+                                        data->frames[i].pixels = NULL;
+                                    int allocated = 0;
+                                    for (; allocated < FRAME_POOL_SIZE; ++allocated) {
+                                        uint8_t *imgData[4] = { };
+                                        int imgLinesizes[4] = { };
+                                        if (av_image_alloc(imgData, imgLinesizes, cc->width, cc->height, AV_PIX_FMT_RGBA, 1) < 0)
+                                            break;
+                                        data->frames[allocated].pixels = imgData[0];
+                                        data->linesize = imgLinesizes[0];
+                                    }
+                                    if (allocated == FRAME_POOL_SIZE) {
+                                        data->frameCount = allocated;
+                                        data->filename = filename;
+                                        data->threading = threading;
+                                        data->threadCount = threadCount;
+                                        data->frame = frame;
+                                        data->fc = fc;
+                                        data->cc = cc;
+                                        data->streamId = streamId;
+                                        data->timeBase = fc->streams[streamId]->time_base;
+                                        data->startTime = fc->streams[streamId]->start_time != AV_NOPTS_VALUE ? fc->streams[streamId]->start_time : 0;
+                                        data->frameDuration = fc->streams[streamId]->r_frame_rate.num > 0 ? av_rescale_q(1, av_inv_q(fc->streams[streamId]->r_frame_rate), data->timeBase) : 1;
+                                        data->seekDistance = (long long) (SEEK_DISTANCE*data->timeBase.den/data->timeBase.num);
+                                        data->sc = sc;
+                                        data->scMatrix = BT601;
+                                        data->scFullRange = false;
+                                        data->scColorspaceSet = false;
+                                        data->width = cc->width;
+                                        data->height = cc->height;
+                                        return new VideoDecoder(data);
+                                    }
+                                    while (allocated > 0)
+                                        av_freep(&data->frames[--allocated].pixels);
+                                    delete data;
+                                    av_frame_free(&frame);
+                                }
+                                sws_freeContext(sc);
+                            }
+                            avcodec_close(cc);
+                        }
+                    }
+                    avcodec_free_context(&cc);
+                }
+            }
+        }
+        avformat_close_input(&fc);
+    }
+    return NULL;
+}
+
+VideoDecoder::VideoDecoder(VideoDecoderData *data) : data(data) {
+    for (int i = 0; i < FRAME_POOL_SIZE+MAX_EXTRA_FRAMES; ++i) {
+        if (data->frames[i].pixels)
+            data->freeFrames.push_back(&data->frames[i]);
+        data->references[i] = 0;
+    }
+    data->excessFrames = 0;
+    data->generation = 0;
+    data->skipUntil = LLONG_MIN;
+    data->position = 0;
+    data->repeat = false;
+    data->keyframeSeek = false;
+    data->keyframeSeekForward = false;
+    data->skipMode = SKIP_NONE;
+    data->finished = false;
+    data->stopRequested = false;
+    data->atStart = true;
+    data->codecPosition = 0;
+    data->reachedEnd = false;
+    data->streamEnd = LLONG_MAX;
+    data->startFrames = 0;
+    data->primedEnd = LLONG_MIN;
+    data->standbyFc = NULL;
+    data->standbyCc = NULL;
+    data->standbyFrame = NULL;
+    data->standbyPrimed = false;
+    data->standbyRewound = true;
+    data->standbyFailed = false;
+    data->frameCacheSize = 0;
+    data->frameCacheReserved = 0;
+    data->frameCacheRepeat = false;
+    data->thread = std::thread(&VideoDecoder::run, this);
+}
+
+VideoDecoder::~VideoDecoder() {
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        data->stopRequested = true;
+        data->decodeCondition.notify_all();
+    }
+    if (data->thread.joinable())
+        data->thread.join();
+    for (int i = 0; i < FRAME_POOL_SIZE+MAX_EXTRA_FRAMES; ++i)
+        av_freep(&data->frames[i].pixels);
+    setUpFrameCache(false, LLONG_MAX);
+    sws_freeContext(data->sc);
+    av_frame_free(&data->frame);
+    avcodec_close(data->cc);
+    avcodec_free_context(&data->cc);
+    avformat_close_input(&data->fc);
+    delete data;
+}
+
+int VideoDecoder::getWidth() const {
+    return data->width;
+}
+
+int VideoDecoder::getHeight() const {
+    return data->height;
+}
+
+void VideoDecoder::getFramerate(int &num, int &den) const {
+    num = data->fc->streams[data->streamId]->r_frame_rate.num;
+    den = data->fc->streams[data->streamId]->r_frame_rate.den;
+}
+
+void VideoDecoder::getTimeBase(int &num, int &den) const {
+    num = data->timeBase.num;
+    den = data->timeBase.den;
+}
+
+float VideoDecoder::getDuration() const {
+    return (float) data->fc->duration/AV_TIME_BASE;
+}
+
+void VideoDecoder::setRepeat(bool repeat) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    data->repeat = repeat;
+}
+
+void VideoDecoder::rewind() {
+    seek(0);
+}
+
+void VideoDecoder::seek(long long timestamp) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    requestSeek(timestamp);
+}
+
+void VideoDecoder::seekKeyframe(long long timestamp) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    requestKeyframeSeek(timestamp, true);
+}
+
+void VideoDecoder::setSkipMode(SkipMode mode) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    data->skipMode = mode;
+}
+
+long long VideoDecoder::getKeyframeInterval() const {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    if (data->keyframes.size() < 2)
+        return 0;
+    return (data->keyframes.back()-data->keyframes.front())/(long long) (data->keyframes.size()-1);
+}
+
+const VideoDecoder::Frame * VideoDecoder::nextFrame() {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (data->readyFrames.empty() && !data->finished)
+        data->readyCondition.wait(lock);
+    if (data->readyFrames.empty())
+        return NULL;
+    Frame *frame = data->readyFrames.front();
+    data->readyFrames.pop_front();
+    data->references[frame-data->frames] = 1;
+    return frame;
+}
+
+const VideoDecoder::Frame * VideoDecoder::frameAt(long long timestamp) {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    bool seeking = false;
+    while (true) {
+        while (!data->readyFrames.empty()) {
+            Frame *frame = data->readyFrames.front();
+            if (frame->pts+frame->duration <= timestamp) {
+                data->readyFrames.pop_front();
+                data->freeFrames.push_back(frame);
+                data->decodeCondition.notify_all();
+                continue;
+            }
+            if (frame->pts <= timestamp || seeking) {
+                data->readyFrames.pop_front();
+                data->references[frame-data->frames] = 1;
+                return frame;
+            }
+            // The requested frame may follow after the decoder has looped back to the start
+            std::deque<Frame *>::iterator loopStart = std::find_if(data->readyFrames.begin()+1, data->readyFrames.end(), [](const Frame *frame) {
+                return frame->loopStart;
+            });
+            if (loopStart == data->readyFrames.end())
+                break;
+            data->freeFrames.insert(data->freeFrames.end(), data->readyFrames.begin(), loopStart);
+            data->readyFrames.erase(data->readyFrames.begin(), loopStart);
+            data->decodeCondition.notify_all();
+        }
+        if (!seeking) {
+            bool behind = data->readyFrames.empty() ? timestamp < data->position : true;
+            bool farAhead = false;
+            if (!behind && timestamp > data->position) {
+                std::vector<long long>::const_iterator keyframe = std::upper_bound(data->keyframes.begin(), data->keyframes.end(), timestamp);
+                farAhead = (keyframe != data->keyframes.begin() && *(keyframe-1) > data->position) || timestamp-data->position > data->seekDistance;
+            }
+            if (behind || farAhead) {
+                requestSeek(timestamp);
+                seeking = true;
+                continue;
+            }
+        }
+        if (data->readyFrames.empty() && data->finished)
+            return NULL;
+        if (timestamp > data->skipUntil)
+            data->skipUntil = timestamp;
+        data->readyCondition.wait(lock);
+    }
+}
+
+const VideoDecoder::Frame * VideoDecoder::keyframeAt(long long timestamp) {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    if (data->readyFrames.empty() || data->readyFrames.front()->pts > timestamp || data->readyFrames.front()->pts+data->readyFrames.front()->duration <= timestamp)
+        requestKeyframeSeek(timestamp, false);
+    while (data->readyFrames.empty()) {
+        if (data->finished)
+            return NULL;
+        data->readyCondition.wait(lock);
+    }
+    Frame *frame = data->readyFrames.front();
+    data->readyFrames.pop_front();
+    data->references[frame-data->frames] = 1;
+    return frame;
+}
+
+void VideoDecoder::retainFrame(const Frame *frame) {
+    if (!frame)
+        return;
+    std::lock_guard<std::mutex> lock(data->mutex);
+    ++data->references[frame-data->frames];
+}
+
+void VideoDecoder::releaseFrame(const Frame *frame) {
+    if (!frame)
+        return;
+    std::lock_guard<std::mutex> lock(data->mutex);
+    if (--data->references[frame-data->frames] > 0)
+        return;
+    data->freeFrames.push_back(const_cast<Frame *>(frame));
+    data->decodeCondition.notify_all();
+}
+
+bool VideoDecoder::addFrames(int count) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    // Buffers which are still waiting to be freed are kept instead
+    int kept = std::min(count, data->excessFrames);
+    data->excessFrames -= kept;
+    count -= kept;
+    if (data->frameCount+count > FRAME_POOL_SIZE+MAX_EXTRA_FRAMES) {
+        data->excessFrames += kept;
+        return false;
+    }
+    for (int i = 0; count > 0; ++i) {
+        Frame *frame = &data->frames[i];
+        if (frame->pixels)
+            continue;
+        uint8_t *imgData[4] = { };
+        int imgLinesizes[4] = { };
+        if (av_image_alloc(imgData, imgLinesizes, data->width, data->height, AV_PIX_FMT_RGBA, 1) < 0)
+            return false;
+        frame->pixels = imgData[0];
+        data->references[i] = 0;
+        data->freeFrames.push_back(frame);
+        ++data->frameCount;
+        --count;
+    }
+    data->decodeCondition.notify_all();
+    return true;
+}
+
+void VideoDecoder::removeFrames(int count) {
+    std::lock_guard<std::mutex> lock(data->mutex);
+    data->excessFrames += count;
+    data->decodeCondition.notify_all();
+}
+
+void VideoDecoder::requestSeek(long long timestamp) {
+    ++data->generation;
+    data->freeFrames.insert(data->freeFrames.end(), data->readyFrames.begin(), data->readyFrames.end());
+    data->readyFrames.clear();
+    data->keyframeSeek = false;
+    data->skipUntil = timestamp;
+    data->position = timestamp;
+    data->finished = false;
+    data->decodeCondition.notify_all();
+}
+
+void VideoDecoder::requestKeyframeSeek(long long timestamp, bool forward) {
+    requestSeek(timestamp);
+    data->keyframeSeek = true;
+    data->keyframeSeekForward = forward;
+    data->skipUntil = LLONG_MIN;
+}
+
+void VideoDecoder::run() {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (!data->stopRequested) {
+        if (data->repeat != data->frameCacheRepeat) {
+            bool repeat = data->repeat;
+            long long streamEnd = data->streamEnd;
+            lock.unlock();
+            setUpFrameCache(repeat, streamEnd);
+            lock.lock();
+            continue;
+        }
+        // Buffers removed by removeFrames are freed once they are returned
+        while (data->excessFrames > 0 && !data->freeFrames.empty() && data->frameCount > FRAME_POOL_SIZE) {
+            av_freep(&data->freeFrames.back()->pixels);
+            data->freeFrames.pop_back();
+            --data->frameCount;
+            --data->excessFrames;
+        }
+        if (data->finished || data->freeFrames.empty()) {
+            // While the queue is full, the standby decoder is prepared for the next loop
+            if (!data->finished && data->repeat && data->streamEnd != LLONG_MAX && data->primedEnd != LLONG_MIN && !data->standbyPrimed && !data->standbyFailed) {
+                lock.unlock();
+                primeStandby();
+                lock.lock();
+            } else
+                data->decodeCondition.wait(lock);
+            continue;
+        }
+        Frame *frame = data->freeFrames.back();
+        data->freeFrames.pop_back();
+        unsigned generation = data->generation;
+        long long position = data->position;
+        long long target = std::max(position, data->skipUntil);
+        bool loopStart = data->repeat && target >= data->streamEnd;
+        bool keyframeSeek = data->keyframeSeek;
+        bool keyframeSeekForward = data->keyframeSeekForward;
+        data->keyframeSeek = false;
+        lock.unlock();
+        if (loopStart)
+            position = target = 0;
+        bool cached = takeCachedFrame(frame, target);
+        bool ok = cached;
+        if (!ok) {
+            bool positioned = true;
+            // The codec only has to be repositioned if its output does not continue from the position, while frames up to the target are skipped anyway
+            if (data->codecPosition != position) {
+                if (data->standbyPrimed && position == data->primedEnd)
+                    swapStandby();
+                else
+                    positioned = reposition(target, generation, keyframeSeek, keyframeSeekForward);
+                data->codecPosition = position;
+            }
+            ok = positioned && decodeFrame();
+        }
+        bool skip = false;
+        if (ok) {
+            lock.lock();
+            updateStreamEnd(generation);
+            if (!cached) {
+                frame->pts = data->frame->best_effort_timestamp != AV_NOPTS_VALUE ? data->frame->best_effort_timestamp-data->startTime : data->position;
+                frame->duration = data->frame->pkt_duration > 0 ? data->frame->pkt_duration : data->frameDuration;
+            }
+            frame->loopStart = loopStart;
+            if (!cached)
+                data->codecPosition = frame->pts+frame->duration;
+            if (generation == data->generation) {
+                if (loopStart)
+                    data->skipUntil = LLONG_MIN;
+                data->position = frame->pts+frame->duration;
+                // Frames preceding a seek target are decoded but not converted
+                skip = data->position <= data->skipUntil;
+            }
+            lock.unlock();
+            if (!skip && !cached) {
+                if (!convertFrame(frame)) {
+                    setUpScalerColorspace();
+                    uint8_t *invImgData[4] = { reinterpret_cast<uint8_t *>(frame->pixels)+data->linesize*(data->height-1) };
+                    int invImgLinesizes[4] = { -data->linesize };
+                    sws_scale(data->sc, data->frame->data, data->frame->linesize, 0, data->height, invImgData, invImgLinesizes);
+                }
+                // Frames at the start are pinned only while the video repeats
+                bool pinned = data->frameCacheRepeat && data->startFrames < LOOP_PRIMED_FRAMES;
+                if (!cacheFrame(frame, pinned) && pinned)
+                    data->startFrames = INT_MAX;
+                else if (pinned && ++data->startFrames == LOOP_PRIMED_FRAMES)
+                    data->primedEnd = frame->pts+frame->duration;
+            } else if (!cached && data->startFrames < LOOP_PRIMED_FRAMES)
+                data->startFrames = INT_MAX;
+        }
+        lock.lock();
+        updateStreamEnd(generation);
+        if (generation != data->generation || skip) // Seeked in the meantime or skipped
+            data->freeFrames.push_back(frame);
+        else if (ok)
+            data->readyFrames.push_back(frame);
+        else {
+            data->freeFrames.push_back(frame);
+            // At the end of a repeated video, the next iteration continues from the start
+            if (!(data->repeat && data->position == data->streamEnd && data->streamEnd > 0))
+                data->finished = true;
+        }
+        data->readyCondition.notify_all();
+    }
+}
+
+bool VideoDecoder::decodeFrame() {
+    data->atStart = false;
+    SkipMode skipMode;
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        skipMode = data->skipMode;
+    }
+    switch (skipMode) {
+        case SKIP_NONE:
+            data->cc->skip_frame = AVDISCARD_DEFAULT;
+            break;
+        case SKIP_NONREF:
+            data->cc->skip_frame = AVDISCARD_NONREF;
+            break;
+        case SKIP_NONKEY:
+            data->cc->skip_frame = AVDISCARD_NONKEY;
+            break;
+    }
+    if (!avcodec_receive_frame(data->cc, data->frame))
+        return true;
+    AVPacket pkt = { };
+    av_init_packet(&pkt);
+    while (av_read_frame(data->fc, &pkt) == 0) {
+        if (pkt.stream_index == data->streamId) {
+            if (pkt.flags&AV_PKT_FLAG_KEY)
+                indexKeyframe(pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts);
+            if (avcodec_send_packet(data->cc, &pkt) < 0) {
+                av_packet_unref(&pkt);
+                return false;
+            }
+            if (!avcodec_receive_frame(data->cc, data->frame)) {
+                av_packet_unref(&pkt);
+                return true;
+            }
+        }
+        av_packet_unref(&pkt);
+    }
+    if (avcodec_send_packet(data->cc, NULL) < 0)
+        return false;
+    if (!avcodec_receive_frame(data->cc, data->frame))
+        return true;
+    data->reachedEnd = true;
+    return false;
+}
+
+void VideoDecoder::setUpScalerColorspace() {
+    const AVFrame *src = data->frame;
+    YuvMatrix matrix = src->colorspace == AVCOL_SPC_BT709 ? BT709 : BT601;
+    bool fullRange = src->color_range == AVCOL_RANGE_JPEG;
+    if (data->scColorspaceSet && matrix == data->scMatrix && fullRange == data->scFullRange)
+        return;
+    const int *coefficients = sws_getCoefficients(matrix == BT709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+    sws_setColorspaceDetails(data->sc, coefficients, fullRange ? 1 : 0, coefficients, 1, 0, 1<<16, 1<<16);
+    data->scMatrix = matrix;
+    data->scFullRange = fullRange;
+    data->scColorspaceSet = true;
+}
+
+bool VideoDecoder::convertFrame(Frame *frame) {
+    const AVFrame *src = data->frame;
+    if (src->width != data->width || src->height != data->height)
+        return false;
+    YuvMatrix matrix = src->colorspace == AVCOL_SPC_BT709 ? BT709 : BT601;
+    return yuvToRgbaFlipped(reinterpret_cast<uint8_t *>(frame->pixels), data->linesize, src->data, src->linesize, src->format, data->width, data->height, matrix, src->color_range == AVCOL_RANGE_JPEG);
+}
+
+bool VideoDecoder::takeCachedFrame(Frame *frame, long long timestamp) {
+    std::map<long long, CachedFrame>::iterator it = data->frameCache.upper_bound(timestamp);
+    if (it == data->frameCache.begin())
+        return false;
+    --it;
+    if (timestamp >= it->first+it->second.duration)
+        return false;
+    memcpy(frame->pixels, it->second.pixels, (size_t) data->linesize*data->height);
+    frame->pts = it->first;
+    frame->duration = it->second.duration;
+    if (!it->second.pinned)
+        data->frameCacheLru.splice(data->frameCacheLru.end(), data->frameCacheLru, it->second.lruPosition);
+    return true;
+}
+
+bool VideoDecoder::cacheFrame(const Frame *frame, bool pinned) {
+    size_t frameSize = (size_t) data->linesize*data->height;
+    std::map<long long, CachedFrame>::iterator existing = data->frameCache.find(frame->pts);
+    if (existing != data->frameCache.end()) {
+        if (pinned && !existing->second.pinned) {
+            data->frameCacheLru.erase(existing->second.lruPosition);
+            data->frameCacheSize -= frameSize;
+            existing->second.pinned = true;
+        }
+        return true;
+    }
+    if (pinned) {
+        void *pixels = av_malloc(frameSize);
+        if (pixels) {
+            memcpy(pixels, frame->pixels, frameSize);
+            CachedFrame &entry = data->frameCache[frame->pts];
+            entry.pixels = pixels;
+            entry.duration = frame->duration;
+            entry.pinned = true;
+        }
+        return pixels != NULL;
+    }
+    if (frameSize > data->frameCacheReserved)
+        return false;
+    void *pixels = NULL;
+    // The least recently used frames are evicted, reusing the buffer of the last one
+    while (data->frameCacheSize+frameSize > data->frameCacheReserved && !data->frameCacheLru.empty()) {
+        std::map<long long, CachedFrame>::iterator evicted = data->frameCache.find(data->frameCacheLru.front());
+        av_free(pixels);
+        pixels = evicted->second.pixels;
+        data->frameCacheLru.pop_front();
+        data->frameCache.erase(evicted);
+        data->frameCacheSize -= frameSize;
+    }
+    if (!pixels && !(pixels = av_malloc(frameSize)))
+        return false;
+    memcpy(pixels, frame->pixels, frameSize);
+    CachedFrame &entry = data->frameCache[frame->pts];
+    entry.pixels = pixels;
+    entry.duration = frame->duration;
+    entry.pinned = false;
+    entry.lruPosition = data->frameCacheLru.insert(data->frameCacheLru.end(), frame->pts);
+    data->frameCacheSize += frameSize;
+    return true;
+}
+
+void VideoDecoder::setUpFrameCache(bool repeat, long long streamEnd) {
+    // Cached and pinned frames as well as the standby decoder only serve repeating, so they are discarded along with the reservation
+    for (std::map<long long, CachedFrame>::iterator it = data->frameCache.begin(); it != data->frameCache.end(); ++it)
+        av_free(it->second.pixels);
+    data->frameCache.clear();
+    data->frameCacheLru.clear();
+    data->frameCacheSize = 0;
+    closeStandby();
+    data->primedEnd = LLONG_MIN;
+    // Frames are pinned from the next time the codec starts at the beginning
+    data->startFrames = repeat && data->codecPosition == 0 ? 0 : INT_MAX;
+    std::lock_guard<std::mutex> lock(frameCacheBudgetMutex);
+    frameCacheBudgetUsed -= data->frameCacheReserved;
+    data->frameCacheReserved = 0;
+    data->frameCacheRepeat = repeat;
+    if (!repeat)
+        return;
+    // The whole clip is reserved, so that it is never evicted while looping and decoders of other clips are not starved
+    const AVStream *stream = data->fc->streams[data->streamId];
+    long long duration = streamEnd;
+    if (duration == LLONG_MAX)
+        duration = stream->duration != AV_NOPTS_VALUE ? stream->duration : data->fc->duration != AV_NOPTS_VALUE ? av_rescale_q(data->fc->duration, AV_TIME_BASE_Q, data->timeBase) : -1;
+    if (duration <= 0 || data->frameDuration <= 0)
+        return;
+    unsigned long long clipSize = (unsigned long long) (duration/data->frameDuration+1)*data->linesize*data->height;
+    if (clipSize <= FRAME_CACHE_BUDGET-frameCacheBudgetUsed) {
+        data->frameCacheReserved = (size_t) clipSize;
+        frameCacheBudgetUsed += data->frameCacheReserved;
+    }
+}
+
+void VideoDecoder::updateStreamEnd(unsigned generation) {
+    // The end of the last frame preceding the end of the file, which is where looping continues from the start
+    if (data->reachedEnd) {
+        data->reachedEnd = false;
+        if (generation == data->generation)
+            data->streamEnd = data->position;
+    }
+}
+
+void VideoDecoder::primeStandby() {
+    if (!data->standbyCc) {
+        AVFormatContext *fc = NULL;
+        if (avformat_open_input(&fc, data->filename.c_str(), NULL, NULL) >= 0) {
+            if (avformat_find_stream_info(fc, NULL) >= 0 && data->streamId < (int) fc->nb_streams) {
+                AVCodecContext *cc = avcodec_alloc_context3(data->cc->codec);
+                if (cc) {
+                    AVDictionary *options = NULL;
+                    if (avcodec_parameters_to_context(cc, fc->streams[data->streamId]->codecpar) >= 0) {
+                        setThreading(cc, data->threading, data->threadCount);
+                        if (avcodec_open2(cc, data->cc->codec, &options) >= 0 && (data->standbyFrame = av_frame_alloc())) {
+                            data->standbyFc = fc;
+                            data->standbyCc = cc;
+                        }
+                    }
+                    if (!data->standbyCc)
+                        avcodec_free_context(&cc);
+                }
+            }
+            if (!data->standbyFc)
+                avformat_close_input(&fc);
+        }
+        if (!data->standbyCc) {
+            data->standbyFailed = true;
+            return;
+        }
+    }
+    if (!data->standbyRewound) {
+        avcodec_flush_buffers(data->standbyCc);
+        if (av_seek_frame(data->standbyFc, -1, data->standbyFc->start_time, 0) < 0) {
+            data->standbyFailed = true;
+            return;
+        }
+        data->standbyRewound = true;
+    }
+    // Decodes one frame and checks if it is the last of the pinned ones
+    bool decoded = !avcodec_receive_frame(data->standbyCc, data->standbyFrame);
+    AVPacket pkt = { };
+    av_init_packet(&pkt);
+    while (!decoded && av_read_frame(data->standbyFc, &pkt) == 0) {
+        if (pkt.stream_index == data->streamId && avcodec_send_packet(data->standbyCc, &pkt) >= 0)
+            decoded = !avcodec_receive_frame(data->standbyCc, data->standbyFrame);
+        av_packet_unref(&pkt);
+    }
+    if (!decoded || data->standbyFrame->best_effort_timestamp == AV_NOPTS_VALUE) {
+        data->standbyFailed = true;
+        return;
+    }
+    long long pts = data->standbyFrame->best_effort_timestamp-data->startTime;
+    long long duration = data->standbyFrame->pkt_duration > 0 ? data->standbyFrame->pkt_duration : data->frameDuration;
+    data->standbyPrimed = pts+duration >= data->primedEnd;
+}
+
+void VideoDecoder::closeStandby() {
+    av_frame_free(&data->standbyFrame);
+    avcodec_free_context(&data->standbyCc);
+    avformat_close_input(&data->standbyFc);
+    data->standbyPrimed = false;
+    data->standbyRewound = true;
+    data->standbyFailed = false;
+}
+
+void VideoDecoder::swapStandby() {
+    std::swap(data->fc, data->standbyFc);
+    std::swap(data->cc, data->standbyCc);
+    data->atStart = false;
+    data->standbyPrimed = false;
+    data->standbyRewound = false;
+}
+
+bool VideoDecoder::reposition(long long target, unsigned generation, bool keyframeSeek, bool keyframeSeekForward) {
+    if (keyframeSeek)
+        return seekToKeyframe(target, keyframeSeekForward);
+    if (!seekTo(target))
+        return false;
+    // Frames between the keyframe and the target must not be delivered, which also applies when the codec has fallen behind the position by frames taken from the cache
+    std::lock_guard<std::mutex> lock(data->mutex);
+    if (generation == data->generation && data->skipUntil < target)
+        data->skipUntil = target;
+    return true;
+}
+
+bool VideoDecoder::seekTo(long long timestamp) {
+    if (timestamp <= 0) {
+        if (data->primedEnd == LLONG_MIN)
+            data->startFrames = 0;
+        if (data->atStart)
+            return true;
+        avcodec_flush_buffers(data->cc);
+        if (av_seek_frame(data->fc, -1, data->fc->start_time, 0) < 0)
+            return false;
+        data->atStart = true;
+        return true;
+    }
+    long long keyframe = LLONG_MIN;
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        std::vector<long long>::const_iterator it = std::upper_bound(data->keyframes.begin(), data->keyframes.end(), timestamp);
+        if (it != data->keyframes.begin())
+            keyframe = *(it-1);
+    }
+    avcodec_flush_buffers(data->cc);
+    if (data->primedEnd == LLONG_MIN)
+        data->startFrames = INT_MAX;
+    data->atStart = false;
+    // Let the demuxer look for a closer keyframe than the nearest one indexed so far
+    if (avformat_seek_file(data->fc, data->streamId, keyframe != LLONG_MIN ? data->startTime+keyframe : INT64_MIN, data->startTime+timestamp, data->startTime+timestamp, 0) >= 0)
+        return true;
+    return keyframe != LLONG_MIN && av_seek_frame(data->fc, data->streamId, data->startTime+keyframe, AVSEEK_FLAG_BACKWARD) >= 0;
+}
+
+bool VideoDecoder::seekToKeyframe(long long timestamp, bool forward) {
+    avcodec_flush_buffers(data->cc);
+    if (data->primedEnd == LLONG_MIN)
+        data->startFrames = INT_MAX;
+    data->atStart = false;
+    if (forward ? avformat_seek_file(data->fc, data->streamId, data->startTime+timestamp, data->startTime+timestamp, INT64_MAX, 0) >= 0 : avformat_seek_file(data->fc, data->streamId, INT64_MIN, data->startTime+timestamp, data->startTime+timestamp, 0) >= 0)
+        return true;
+    return seekTo(timestamp);
+}
+
+void VideoDecoder::indexKeyframe(long long pts) {
+    if (pts == AV_NOPTS_VALUE)
+        return;
+    pts -= data->startTime;
+    std::lock_guard<std::mutex> lock(data->mutex);
+    std::vector<long long>::iterator it = std::lower_bound(data->keyframes.begin(), data->keyframes.end(), pts);
+    if (it == data->keyframes.end() || *it != pts)
+        data->keyframes.insert(it, pts);
+}
@@ -0,0 +1,94 @@
+
+#pragma once
+
+struct AVPacket;
+
+/// Decodes a video file on a background thread into a queue of ready RGBA frames
+class VideoDecoder {
+
+public:
+    enum ThreadingMode {
+        AUTO,
+        SINGLE,
+        FRAME,
+        SLICE
+    };
+
+    /// Frames which the codec discards instead of decoding, to catch up with realtime playback
+    enum SkipMode {
+        SKIP_NONE,
+        SKIP_NONREF,
+        SKIP_NONKEY
+    };
+
+    /// A decoded frame, converted to vertically flipped RGBA. Timestamps are in time base units relative to the start of the stream.
+    struct Frame {
+        void *pixels;
+        long long pts, duration;
+        bool loopStart;
+    };
+
+    /// Opens a video file. Thread count of zero selects the number of decoding threads automatically.
+    static VideoDecoder * open(const char *filename, ThreadingMode threading = AUTO, int threadCount = 0);
+
+    VideoDecoder(const VideoDecoder &) = delete;
+    ~VideoDecoder();
+    VideoDecoder & operator=(const VideoDecoder &) = delete;
+    int getWidth() const;
+    int getHeight() const;
+    void getFramerate(int &num, int &den) const;
+    void getTimeBase(int &num, int &den) const;
+    float getDuration() const;
+    void setRepeat(bool repeat);
+    /// Discards all queued frames and restarts decoding from the beginning of the file
+    void rewind();
+    /// Discards all queued frames and restarts decoding from the frame displayed at timestamp
+    void seek(long long timestamp);
+    /// Discards all queued frames and continues decoding from the first keyframe at or after timestamp
+    void seekKeyframe(long long timestamp);
+    void setSkipMode(SkipMode mode);
+    /// Returns the average distance between the keyframes found so far, or zero if unknown
+    long long getKeyframeInterval() const;
+    /// Waits for the next decoded frame. Returns NULL at the end of the file.
+    const Frame * nextFrame();
+    /// Returns the frame displayed at timestamp, skipping or seeking to it as necessary. Returns NULL past the end of the file.
+    const Frame * frameAt(long long timestamp);
+    /// Returns the last keyframe at or before timestamp, or the exact frame if it is cached, for a quick preview. Returns NULL past the end of the file.
+    const Frame * keyframeAt(long long timestamp);
+    /// Adds a reference to a frame obtained from nextFrame or frameAt, which must be matched by an additional releaseFrame
+    void retainFrame(const Frame *frame);
+    /// Returns a frame obtained from nextFrame to the decoder so that its buffer may be reused once all references are released
+    void releaseFrame(const Frame *frame);
+    /// Adds frame buffers for consumers which hold frames in addition to the first one. Returns false if the limit has been reached.
+    bool addFrames(int count);
+    /// Frees frame buffers previously added by addFrames once they are no longer in use
+    void removeFrames(int count);
+
+private:
+    struct VideoDecoderData;
+
+    VideoDecoderData *data;
+
+    explicit VideoDecoder(VideoDecoderData *data);
+    void requestSeek(long long timestamp);
+    void requestKeyframeSeek(long long timestamp, bool forward);
+    void run();
+    bool decodeFrame();
+    bool convertFrame(Frame *frame);
+    /// Sets the color matrix and range of the swscale fallback to those the SIMD conversion would use for the current frame
+    void setUpScalerColorspace();
+    bool takeCachedFrame(Frame *frame, long long timestamp);
+    bool cacheFrame(const Frame *frame, bool pinned);
+    /// Discards all cached frames and the standby decoder, and reserves a part of the shared frame cache budget if the clip is repeated and fits into it
+    void setUpFrameCache(bool repeat, long long streamEnd);
+    void primeStandby();
+    void swapStandby();
+    void closeStandby();
+    void updateStreamEnd(unsigned generation);
+    /// Seeks the codec to the target of the current iteration of run, so that frames preceding it are skipped
+    bool reposition(long long target, unsigned generation, bool keyframeSeek, bool keyframeSeekForward);
+    bool seekTo(long long timestamp);
+    bool seekToKeyframe(long long timestamp, bool forward);
+    void indexKeyframe(long long pts);
+
+};
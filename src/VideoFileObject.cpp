@@ -1,59 +1,60 @@
 
 #include "VideoFileObject.h"
 
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 extern "C" {
-    #include <libavutil/imgutils.h>
-    #include <libavformat/avformat.h>
-    #include <libswscale/swscale.h>
-}
-
-struct VideoFileData {
-    AVFrame *frame;
-    AVFormatContext *fc;
-    AVCodecContext *cc;
-    int streamId;
-    AVRational timeBase;
-    uint8_t *imgData[4];
-    int imgLinesizes[4];
-    uint8_t *invImgData[4];
-    int invImgLinesizes[4];
-    SwsContext *sc;
-};
-
-VideoFileObject::VideoFileObject(const std::string &name, const std::string &filename) : LogicalObject(name), data(new VideoFileData), initialFilename(filename) {
+    #include <libavutil/log.h>
+    #include <libavutil/mem.h>
+}
+
+// Number of frames realtime playback has to fall behind before non-reference frames are dropped
+#define CATCH_UP_NONREF_FRAMES 2
+// Number of frames realtime playback has to fall behind before all but keyframes are dropped
+#define CATCH_UP_NONKEY_FRAMES 8
+// Minimum jump of the requested time in seconds in either direction to be treated as scrubbing rather than stepping through the video
+#define SCRUB_DISTANCE 0.5
+// Time in milliseconds without further movement of the playhead after which scrubbing is over and the exact frame is decoded
+#define SCRUB_SETTLE_TIME 250
+// Time in milliseconds before the file is opened again after an own decoder could not be opened
+#define REOPEN_RETRY_DELAY 1000
+
+VideoFileObject::VideoFileObject(const std::string &name, SharedVideoDecoder::Pool *decoderPool, const std::string &filename, VideoDecoder::ThreadingMode threading, int threadCount, bool scrub) : LogicalObject(name), decoderPool(decoderPool), sharedDecoder(NULL), lockstep(false), decoder(NULL), resumeOwnDecoder(false), currentFrame(NULL), nextLeaseId(1), initialFilename(filename), threading(threading), threadCount(threadCount), scrub(scrub) {
     prepared = false;
-    fileOpen = false;
     width = 0, height = 0;
     repeat = false;
     atStart = false;
     atLastFrame = false;
-    frameEndTime = 0;
     frameRemainingTime = 0;
-    data->frame = av_frame_alloc();
-    data->fc = NULL;
-    data->cc = NULL;
-    data->streamId = 0;
-    memset(data->imgData, 0, sizeof(data->imgData));
-    memset(data->imgLinesizes, 0, sizeof(data->imgLinesizes));
-    memset(data->imgData, 0, sizeof(data->invImgData));
-    memset(data->imgLinesizes, 0, sizeof(data->invImgLinesizes));
-    data->sc = NULL;
+    playPosition = 0;
+    skipMode = VideoDecoder::SKIP_NONE;
+    droppedFrames = 0;
+    reportedDroppedFrames = 0;
+    previousTime = 0.f;
+    scrubbing = false;
 }
 
 VideoFileObject::~VideoFileObject() {
     unloadFile();
-    if (data->frame)
-        av_frame_free(&data->frame);
-    delete data;
 }
 
-VideoFileObject * VideoFileObject::reconfigure(const std::string &filename) {
+VideoFileObject * VideoFileObject::reconfigure(const std::string &filename, VideoDecoder::ThreadingMode threading, int threadCount, bool scrub) {
     initialFilename = filename;
+    this->threading = threading;
+    this->threadCount = threadCount;
+    this->scrub = scrub;
+    if (!scrub)
+        scrubbing = false;
     return this;
 }
 
 bool VideoFileObject::prepare(int &width, int &height, bool hardReset, bool repeat) {
     this->repeat = repeat;
+    if (decoder)
+        setRepeat();
     if (!prepared || hardReset) {
         if (!initialFilename.empty())
             loadFile(initialFilename.c_str());
@@ -70,17 +71,16 @@ bool VideoFileObject::getSize(int &width, int &height) const {
 }
 
 bool VideoFileObject::getFramerate(int &num, int &den) const {
-    if (fileOpen) {
-        num = data->fc->streams[data->streamId]->r_frame_rate.num;
-        den = data->fc->streams[data->streamId]->r_frame_rate.den;
+    if (decoder) {
+        decoder->getFramerate(num, den);
         return true;
     }
     return false;
 }
 
 bool VideoFileObject::getDuration(float &duration) const {
-    if (fileOpen) {
-        duration = (float) data->fc->duration/AV_TIME_BASE;
+    if (decoder) {
+        duration = decoder->getDuration();
         return true;
     }
     return false;
@@ -96,79 +96,52 @@ bool VideoFileObject::loadFile(const char *filename) {
             return false;
         filename = initialFilename.c_str();
     }
-    AVFormatContext *fc = NULL;
-    if (data->frame) {
-        if (avformat_open_input(&fc, filename, NULL, NULL) >= 0) {
-            if (avformat_find_stream_info(fc, NULL) >= 0) {
-                AVCodec *decoder = NULL;
-                int streamId = av_find_best_stream(fc, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-                if (streamId >= 0 && decoder) {
-                    AVCodecContext *cc = avcodec_alloc_context3(decoder);
-                    if (cc) {
-                        const AVCodecParameters *codecpar = fc->streams[streamId]->codecpar;
-                        if (avcodec_parameters_to_context(cc, codecpar) >= 0) {
-                            AVDictionary *options = NULL;
-                            if (avcodec_open2(cc, decoder, &options) >= 0) {
-                                SwsContext *sc = sws_getContext(cc->width, cc->height, cc->pix_fmt, cc->width, cc->height, AV_PIX_FMT_RGBA, 0, NULL, NULL, NULL);
-                                if (sc) {
-                                    uint8_t *imgData[4] = { };
-                                    int imgLinesizes[4] = { };
-                                    int bitmapSize = av_image_alloc(imgData, imgLinesizes, cc->width, cc->height, AV_PIX_FMT_RGBA, 1);
-                                    if (bitmapSize >= 0) {
-                                        unloadFile();
-                                        data->fc = fc;
-                                        data->cc = cc;
-                                        data->streamId = streamId;
-                                        data->timeBase = fc->streams[streamId]->time_base;
-                                        for (int i = 0; i < 4; ++i) {
-                                            data->imgData[i] = imgData[i];
-                                            data->imgLinesizes[i] = imgLinesizes[i];
-                                            data->invImgData[i] = imgData[i]+imgLinesizes[i]*(cc->height-1);
-                                            data->invImgLinesizes[i] = -imgLinesizes[i];
-                                        }
-                                        data->sc = sc;
-                                        width = cc->width;
-                                        height = cc->height;
-                                        fileOpen = true;
-                                        atStart = true;
-                                        atLastFrame = false;
-                                        frameEndTime = 0;
-                                        frameRemainingTime = 0;
-                                        return true;
-                                    }
-                                    sws_freeContext(sc);
-                                }
-                                avcodec_close(cc);
-                            }
-                        }
-                        avcodec_free_context(&cc);
-                    }
-                }
-            }
-            avformat_close_input(&fc);
-        }
+    SharedVideoDecoder::Consumer newConsumer = { };
+    SharedVideoDecoder *newSharedDecoder = decoderPool ? decoderPool->acquire(filename, threading, threadCount, newConsumer) : NULL;
+    VideoDecoder *newDecoder = newSharedDecoder ? newSharedDecoder->getDecoder() : VideoDecoder::open(filename, threading, threadCount);
+    if (newDecoder) {
+        unloadFile();
+        sharedDecoder = newSharedDecoder;
+        consumer = newConsumer;
+        lockstep = sharedDecoder != NULL;
+        decoder = newDecoder;
+        this->filename = filename;
+        setRepeat();
+        width = decoder->getWidth();
+        height = decoder->getHeight();
+        atStart = true;
+        atLastFrame = false;
+        frameRemainingTime = 0;
+        playPosition = 0;
+        skipMode = VideoDecoder::SKIP_NONE;
+        droppedFrames = 0;
+        reportedDroppedFrames = 0;
+        previousTime = 0.f;
+        scrubbing = false;
+        return true;
     }
     return false;
 }
 
 void VideoFileObject::unloadFile() {
-    fileOpen = false;
-    if (data->imgData[0])
-        av_freep(&data->imgData[0]);
-    if (data->sc) {
-        sws_freeContext(data->sc);
-        data->sc = NULL;
-    }
-    if (data->cc) {
-        avcodec_close(data->cc);
-        avcodec_free_context(&data->cc);
+    if (ownDecoder.valid())
+        delete ownDecoder.get();
+    if (decoder) {
+        releaseFrames();
+        if (lockstep)
+            sharedDecoder->leaveLockstep(consumer);
+        if (sharedDecoder)
+            decoderPool->release(sharedDecoder);
+        else
+            delete decoder;
+        sharedDecoder = NULL;
+        lockstep = false;
+        decoder = NULL;
     }
-    if (data->fc)
-        avformat_close_input(&data->fc);
 }
 
 bool VideoFileObject::restart() {
-    if (fileOpen && !atStart) {
+    if (decoder && !atStart) {
         rewind();
         return true;
     }
@@ -176,77 +149,346 @@ bool VideoFileObject::restart() {
 }
 
 bool VideoFileObject::pixelsReady() const {
-    return fileOpen;
+    return decoder != NULL;
+}
+
+void VideoFileObject::setRepeat() {
+    if (lockstep && !sharedDecoder->setRepeat(repeat))
+        diverge(true);
+    if (!lockstep && !sharedDecoder)
+        decoder->setRepeat(repeat);
 }
 
 bool VideoFileObject::rewind() {
     if (atStart)
         return true;
-    avcodec_flush_buffers(data->cc);
-    if (av_seek_frame(data->fc, -1, data->fc->start_time, 0) < 0)
-        return false;
+    if (lockstep && !sharedDecoder->rewind(consumer))
+        diverge(false);
+    decoder->releaseFrame(currentFrame);
+    currentFrame = NULL;
+    if (!lockstep) {
+        if (sharedDecoder)
+            resumeOwnDecoder = false;
+        else
+            decoder->rewind();
+    }
     atStart = true;
     atLastFrame = false;
-    frameEndTime = 0;
     frameRemainingTime = 0;
+    playPosition = 0;
     return true;
 }
 
 bool VideoFileObject::nextFrame() {
-    bool prevAtStart = atStart;
+    const VideoDecoder::Frame *frame = NULL;
+    if (lockstep && !sharedDecoder->nextFrame(consumer, frame))
+        diverge(true);
+    if (!lockstep) {
+        if (sharedDecoder)
+            return false;
+        frame = decoder->nextFrame();
+    }
     atStart = false;
-    if (!avcodec_receive_frame(data->cc, data->frame))
-        return true;
-    AVPacket pkt = { };
-    av_init_packet(&pkt);
-    while (av_read_frame(data->fc, &pkt) == 0) {
-        if (pkt.stream_index == data->streamId) {
-            if (avcodec_send_packet(data->cc, &pkt) < 0) {
-                av_packet_unref(&pkt);
-                return false;
-            }
-            if (!avcodec_receive_frame(data->cc, data->frame)) {
-                av_packet_unref(&pkt);
-                return true;
-            }
-        }
-        av_packet_unref(&pkt);
+    decoder->releaseFrame(currentFrame);
+    if (!(currentFrame = frame)) {
+        atLastFrame = true;
+        return false;
     }
-    if (avcodec_send_packet(data->cc, NULL) < 0)
+    if (currentFrame->loopStart)
+        frameRemainingTime = 0;
+    return true;
+}
+
+bool VideoFileObject::seekFrame(float time) {
+    setSkipMode(VideoDecoder::SKIP_NONE);
+    const VideoDecoder::Frame *frame = NULL;
+    if (lockstep && !sharedDecoder->frameAt(consumer, timestamp(time), frame))
+        diverge(false);
+    if (!lockstep) {
+        if (sharedDecoder)
+            return false;
+        frame = decoder->frameAt(timestamp(time));
+    }
+    if (!frame)
         return false;
-    if (!avcodec_receive_frame(data->cc, data->frame))
-        return true;
-    if (repeat && !prevAtStart)
-        return rewind() && nextFrame();
-    atLastFrame = true;
-    return false;
+    atStart = false;
+    decoder->releaseFrame(currentFrame);
+    currentFrame = frame;
+    return true;
+}
+
+bool VideoFileObject::scrubFrame(float time) {
+    const VideoDecoder::Frame *frame = NULL;
+    if (lockstep && !sharedDecoder->keyframeAt(consumer, timestamp(time), frame))
+        diverge(false);
+    // Only keyframes are decoded until the playhead settles, when the exact frame is found by seekFrame
+    setSkipMode(VideoDecoder::SKIP_NONKEY);
+    if (!lockstep) {
+        if (sharedDecoder)
+            return false;
+        frame = decoder->keyframeAt(timestamp(time));
+    }
+    if (!frame)
+        return false;
+    atStart = false;
+    decoder->releaseFrame(currentFrame);
+    currentFrame = frame;
+    return true;
+}
+
+long long VideoFileObject::timestamp(float time) const {
+    double seconds = (double) time;
+    if (repeat) {
+        double duration = (double) decoder->getDuration();
+        if (duration > 0.0)
+            seconds = fmod(seconds, duration);
+    }
+    int timeBaseNum, timeBaseDen;
+    decoder->getTimeBase(timeBaseNum, timeBaseDen);
+    return (long long) floor(seconds*timeBaseDen/timeBaseNum+.5);
 }
 
 bool VideoFileObject::isFrameCurrent(float time, bool realTime) {
     if (realTime) {
         return frameRemainingTime > 0.0;
     } else {
-        double frameEndRealTime = (double) frameEndTime*data->timeBase.num/data->timeBase.den;
-        return frameEndRealTime > (double) time;
+        long long ts = timestamp(time);
+        return currentFrame && currentFrame->pts <= ts && ts < currentFrame->pts+currentFrame->duration;
     }
 }
 
-const void * VideoFileObject::fetchPixels(float time, float deltaTime, bool realTime, int width, int height) {
-    if (fileOpen && width == this->width && height == this->height) {
+const void * VideoFileObject::fetchPixels(float time, float deltaTime, bool realTime, int width, int height, void *&pixelsContext) {
+    if (decoder && width == this->width && height == this->height) {
+        if (!realTime) {
+            if (!adoptOwnDecoder())
+                return NULL;
+            // Exports rely on exact frames, so only objects declared with the scrub keyword show keyframes while scrubbing
+            if (scrub && isScrubbing(time, deltaTime)) {
+                // The keyframe shown for the same time is kept until the playhead settles
+                if (time == previousTime || isFrameCurrent(time, realTime) || !scrubFrame(time)) {
+                    previousTime = time;
+                    return NULL;
+                }
+            } else if (isFrameCurrent(time, realTime) || !seekFrame(time)) {
+                previousTime = time;
+                return NULL;
+            }
+            previousTime = time;
+            return leaseFrame(pixelsContext);
+        }
         if (time == 0.f)
             rewind();
         frameRemainingTime -= (double) deltaTime;
-        if (atLastFrame || (!atStart && isFrameCurrent(time, realTime)))
+        // The time spent waiting for an own decoder is caught up with afterwards
+        if (!adoptOwnDecoder() || atLastFrame || (!atStart && isFrameCurrent(time, realTime)))
             return NULL;
-        do {
+        catchUp();
+        while (true) {
             if (!nextFrame())
                 return NULL;
-            int64_t frameDuration = data->frame->pkt_duration;
-            frameEndTime += frameDuration;
-            frameRemainingTime += (double) frameDuration*data->timeBase.num/data->timeBase.den;
-        } while (!isFrameCurrent(time, realTime));
-        sws_scale(data->sc, data->frame->data, data->frame->linesize, 0, height, data->invImgData, data->invImgLinesizes);
-        return data->imgData[0];
+            advancePlayback();
+            if (isFrameCurrent(time, realTime))
+                break;
+            ++droppedFrames;
+        }
+        return leaseFrame(pixelsContext);
     }
     return NULL;
 }
+
+bool VideoFileObject::isScrubbing(float time, float deltaTime) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    float distance = time-previousTime;
+    // Jumping far in either direction, unlike the steps of an export, means that the playhead is being dragged
+    if (fabsf(distance) > SCRUB_DISTANCE && (distance < 0.f || distance > 2.f*deltaTime)) {
+        scrubbing = true;
+        lastScrubTime = now;
+    } else if (scrubbing) {
+        // Smaller moves in rapid succession continue the drag, which is over once the playhead has rested for a while
+        if (distance != 0.f && now-lastScrubTime < std::chrono::milliseconds(SCRUB_SETTLE_TIME))
+            lastScrubTime = now;
+        else if (now-lastScrubTime >= std::chrono::milliseconds(SCRUB_SETTLE_TIME))
+            scrubbing = false;
+    }
+    return scrubbing;
+}
+
+long long VideoFileObject::getDroppedFrameCount() const {
+    return droppedFrames;
+}
+
+void VideoFileObject::catchUp() {
+    VideoDecoder::SkipMode newSkipMode = VideoDecoder::SKIP_NONE;
+    if (!atStart && currentFrame && currentFrame->duration > 0) {
+        int timeBaseNum, timeBaseDen;
+        decoder->getTimeBase(timeBaseNum, timeBaseDen);
+        double timeBase = (double) timeBaseNum/timeBaseDen;
+        double deficit = -frameRemainingTime;
+        long long keyframeInterval = decoder->getKeyframeInterval();
+        if (keyframeInterval > 0 && deficit > keyframeInterval*timeBase) {
+            // More than a whole group of pictures behind, so jump straight to the keyframe following the current time
+            long long target = timestamp((float) (playPosition*timeBase+deficit));
+            if (lockstep)
+                sharedDecoder->seekKeyframe(consumer, target);
+            else if (!sharedDecoder)
+                decoder->seekKeyframe(target);
+            // The catch-up continues until the frames skipped by the jump have been counted
+            setSkipMode(VideoDecoder::SKIP_NONE);
+            return;
+        } else if (deficit > CATCH_UP_NONKEY_FRAMES*currentFrame->duration*timeBase)
+            newSkipMode = VideoDecoder::SKIP_NONKEY;
+        else if (deficit > CATCH_UP_NONREF_FRAMES*currentFrame->duration*timeBase)
+            newSkipMode = VideoDecoder::SKIP_NONREF;
+    }
+    setSkipMode(newSkipMode);
+    // Once caught up, the frames dropped on the way are reported
+    if (newSkipMode == VideoDecoder::SKIP_NONE && droppedFrames > reportedDroppedFrames) {
+        av_log(NULL, AV_LOG_INFO, "%s: dropped %lld frames to catch up with realtime playback\n", getName().c_str(), droppedFrames-reportedDroppedFrames);
+        reportedDroppedFrames = droppedFrames;
+    }
+}
+
+void VideoFileObject::setSkipMode(VideoDecoder::SkipMode mode) {
+    if (mode != skipMode) {
+        skipMode = mode;
+        if (lockstep)
+            sharedDecoder->setSkipMode(consumer, mode);
+        else if (!sharedDecoder)
+            decoder->setSkipMode(mode);
+    }
+}
+
+void VideoFileObject::advancePlayback() {
+    int timeBaseNum, timeBaseDen;
+    decoder->getTimeBase(timeBaseNum, timeBaseDen);
+    long long start = currentFrame->loopStart ? 0 : playPosition;
+    long long end = currentFrame->pts+currentFrame->duration;
+    // Frames discarded by the decoder or skipped by a seek show up as a gap before the current frame, which also counts as played
+    if (currentFrame->pts > start && currentFrame->duration > 0)
+        droppedFrames += (currentFrame->pts-start)/currentFrame->duration;
+    if (end <= start)
+        end = start+currentFrame->duration;
+    frameRemainingTime += (double) (end-start)*timeBaseNum/timeBaseDen;
+    playPosition = end;
+}
+
+void VideoFileObject::releasePixels(void *pixelsContext) {
+    unsigned long long id = (unsigned long long) reinterpret_cast<uintptr_t>(pixelsContext);
+    for (std::vector<Lease>::iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (it->id == id) {
+            Lease lease = *it;
+            leases.erase(it);
+            endLease(lease);
+            return;
+        }
+    }
+}
+
+void VideoFileObject::endLease(const Lease &lease) {
+    if (lease.copy) {
+        av_free(lease.copy);
+        return;
+    }
+    lease.decoder->releaseFrame(lease.frame);
+    if (lease.extraFrame)
+        lease.decoder->removeFrames(1);
+    if (lease.sharedDecoder && lease.sharedDecoder != sharedDecoder && !holdsLeases(lease.sharedDecoder))
+        decoderPool->release(lease.sharedDecoder);
+}
+
+bool VideoFileObject::holdsLeases(const SharedVideoDecoder *sharedDecoder) const {
+    for (std::vector<Lease>::const_iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (it->sharedDecoder == sharedDecoder)
+            return true;
+    }
+    return false;
+}
+
+void VideoFileObject::releaseFrames() {
+    decoder->releaseFrame(currentFrame);
+    currentFrame = NULL;
+    while (!leases.empty()) {
+        Lease lease = leases.back();
+        leases.pop_back();
+        endLease(lease);
+    }
+}
+
+void VideoFileObject::diverge(bool resume) {
+    if (lockstep)
+        sharedDecoder->leaveLockstep(consumer);
+    lockstep = false;
+    resumeOwnDecoder = resume;
+    // Opening the file may take a while, so it is not done on the host's thread
+    std::string filename = this->filename;
+    VideoDecoder::ThreadingMode threading = this->threading;
+    int threadCount = this->threadCount;
+    ownDecoder = std::async(std::launch::async, [filename, threading, threadCount]() {
+        return VideoDecoder::open(filename.c_str(), threading, threadCount);
+    });
+}
+
+bool VideoFileObject::adoptOwnDecoder() {
+    if (lockstep || !sharedDecoder)
+        return true;
+    // The shared decoder is not driven outside of lockstep, so its last frame stays on display until the file has been opened again
+    if (!ownDecoder.valid()) {
+        if (std::chrono::steady_clock::now() >= reopenTime)
+            diverge(resumeOwnDecoder);
+        return false;
+    }
+    if (ownDecoder.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+    VideoDecoder *newDecoder = ownDecoder.get();
+    if (!newDecoder) {
+        reopenTime = std::chrono::steady_clock::now()+std::chrono::milliseconds(REOPEN_RETRY_DELAY);
+        return false;
+    }
+    newDecoder->setRepeat(repeat);
+    newDecoder->setSkipMode(skipMode);
+    if (resumeOwnDecoder && currentFrame) {
+        int timeBaseNum, timeBaseDen;
+        decoder->getTimeBase(timeBaseNum, timeBaseDen);
+        newDecoder->seek(timestamp((float) ((double) (currentFrame->pts+currentFrame->duration)*timeBaseNum/timeBaseDen)));
+    }
+    decoder->releaseFrame(currentFrame);
+    currentFrame = NULL;
+    // Frames of the shared decoder which are still leased to the host are released by their leases
+    SharedVideoDecoder *previousSharedDecoder = sharedDecoder;
+    sharedDecoder = NULL;
+    if (!holdsLeases(previousSharedDecoder))
+        decoderPool->release(previousSharedDecoder);
+    decoder = newDecoder;
+    return true;
+}
+
+const void * VideoFileObject::leaseFrame(void *&pixelsContext) {
+    // The host keeps its own reference to the frame so that the decoder does not reuse its buffer during upload
+    Lease lease = { };
+    lease.decoder = decoder;
+    lease.sharedDecoder = sharedDecoder;
+    lease.frame = currentFrame;
+    // The decoder's frame pool accounts for one leased frame, any further ones need additional buffers
+    for (std::vector<Lease>::const_iterator it = leases.begin(); it != leases.end() && !lease.extraFrame; ++it)
+        lease.extraFrame = it->decoder == decoder;
+    if (lease.extraFrame && !decoder->addFrames(1)) {
+        // Once the decoder has no more buffers to spare, further leases get a copy of the frame, so that the output does not stall while the host holds on to earlier ones
+        if (!(lease.copy = av_malloc((size_t) 4*width*height)))
+            return NULL;
+        memcpy(lease.copy, currentFrame->pixels, (size_t) 4*width*height);
+        lease.decoder = NULL;
+        lease.sharedDecoder = NULL;
+        lease.frame = NULL;
+        lease.extraFrame = false;
+        lease.id = nextLeaseId++;
+        leases.push_back(lease);
+        pixelsContext = reinterpret_cast<void *>((uintptr_t) lease.id);
+        return lease.copy;
+    }
+    // Unique ids keep a late release of an earlier lease from ending a new lease of the same frame
+    lease.id = nextLeaseId++;
+    decoder->retainFrame(currentFrame);
+    leases.push_back(lease);
+    pixelsContext = reinterpret_cast<void *>((uintptr_t) lease.id);
+    return currentFrame->pixels;
+}
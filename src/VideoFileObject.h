@@ -2,20 +2,22 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <future>
+#include <chrono>
 #include "LogicalObject.h"
-
-struct VideoFileData;
+#include "VideoDecoder.h"
+#include "SharedVideoDecoder.h"
 
 /// Video file animation object
 class VideoFileObject : public LogicalObject {
-    friend struct VideoFileData;
 
 public:
-    VideoFileObject(const std::string &name, const std::string &filename = std::string());
+    VideoFileObject(const std::string &name, SharedVideoDecoder::Pool *decoderPool, const std::string &filename = std::string(), VideoDecoder::ThreadingMode threading = VideoDecoder::AUTO, int threadCount = 0, bool scrub = false);
     VideoFileObject(const VideoFileObject &) = delete;
     virtual ~VideoFileObject();
     VideoFileObject & operator=(const VideoFileObject &) = delete;
-    VideoFileObject * reconfigure(const std::string &filename = std::string());
+    VideoFileObject * reconfigure(const std::string &filename = std::string(), VideoDecoder::ThreadingMode threading = VideoDecoder::AUTO, int threadCount = 0, bool scrub = false);
     virtual bool prepare(int &width, int &height, bool hardReset, bool repeat) override;
     virtual bool getSize(int &width, int &height) const override;
     virtual bool getFramerate(int &num, int &den) const override;
@@ -25,22 +27,79 @@ public:
     virtual void unloadFile() override;
     virtual bool restart() override;
     virtual bool pixelsReady() const override;
-    virtual const void * fetchPixels(float time, float deltaTime, bool realTime, int width, int height) override;
+    virtual const void * fetchPixels(float time, float deltaTime, bool realTime, int width, int height, void *&pixelsContext) override;
+    virtual void releasePixels(void *pixelsContext) override;
+    /// Number of frames dropped to catch up with realtime playback since the file was loaded
+    long long getDroppedFrameCount() const;
 
 private:
-    VideoFileData *data;
+    /// A frame held by the host until it calls releasePixels with the lease's id
+    struct Lease {
+        unsigned long long id;
+        VideoDecoder *decoder;
+        // The shared decoder of the frame is kept open until the lease ends, even if the object diverges from it
+        SharedVideoDecoder *sharedDecoder;
+        const VideoDecoder::Frame *frame;
+        // Whether a frame buffer was added to the decoder to make up for the leased one
+        bool extraFrame;
+        // A copy of the frame's pixels owned by the lease instead of a frame of the decoder
+        void *copy;
+    };
+
+    SharedVideoDecoder::Pool *decoderPool;
+    // The decoder of the file may be shared with other objects, which receive the same frames while in lockstep
+    SharedVideoDecoder *sharedDecoder;
+    SharedVideoDecoder::Consumer consumer;
+    bool lockstep;
+    VideoDecoder *decoder;
+    // After diverging from the other consumers, an own decoder of the file is opened in the background while the shared decoder's frame remains on display
+    std::future<VideoDecoder *> ownDecoder;
+    bool resumeOwnDecoder;
+    // If the own decoder could not be opened, it is attempted again after this time
+    std::chrono::steady_clock::time_point reopenTime;
+    std::string filename;
+    const VideoDecoder::Frame *currentFrame;
+    std::vector<Lease> leases;
+    unsigned long long nextLeaseId;
     bool prepared;
-    bool fileOpen;
     int width, height;
     bool repeat;
     std::string initialFilename;
+    VideoDecoder::ThreadingMode threading;
+    int threadCount;
+    // Whether keyframes may be shown in place of exact frames while the playhead is being dragged, only if declared with the scrub keyword since exports need exact frames
+    bool scrub;
 
     bool atStart, atLastFrame;
-    long long frameEndTime;
     double frameRemainingTime;
+    // End timestamp of the frame played in realtime mode, from which the time covered by the next frame is measured
+    long long playPosition;
+    VideoDecoder::SkipMode skipMode;
+    long long droppedFrames;
+    // Part of droppedFrames already written to the log
+    long long reportedDroppedFrames;
+    // Time requested by the previous call in non-realtime mode, to tell when the playhead is being dragged
+    float previousTime;
+    // While scrubbing, only keyframes are shown until no request has moved the playhead for SCRUB_SETTLE_TIME
+    bool scrubbing;
+    std::chrono::steady_clock::time_point lastScrubTime;
 
+    void setRepeat();
     bool rewind();
     bool nextFrame();
+    bool seekFrame(float time);
+    bool scrubFrame(float time);
+    bool isScrubbing(float time, float deltaTime);
+    void setSkipMode(VideoDecoder::SkipMode mode);
+    long long timestamp(float time) const;
     bool isFrameCurrent(float time, bool realTime);
+    void catchUp();
+    void advancePlayback();
+    const void * leaseFrame(void *&pixelsContext);
+    void endLease(const Lease &lease);
+    bool holdsLeases(const SharedVideoDecoder *sharedDecoder) const;
+    void releaseFrames();
+    void diverge(bool resume);
+    bool adoptOwnDecoder();
 
 };
@@ -0,0 +1,85 @@
+
+#include "WorkerPool.h"
+
+#include <vector>
+#include <thread>
+#include <condition_variable>
+
+struct WorkerPool::WorkerPoolData {
+    std::vector<std::thread> threads;
+    // Held for the whole duration of a batch
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable jobCondition;
+    std::condition_variable finishedCondition;
+    const std::function<void(int)> *job;
+    int jobCount;
+    int nextJob;
+    int finishedJobs;
+    bool stopRequested;
+};
+
+WorkerPool::WorkerPool(int threadCount) : data(new WorkerPoolData) {
+    if (threadCount <= 0)
+        threadCount = (int) std::thread::hardware_concurrency();
+    data->job = NULL;
+    data->jobCount = 0;
+    data->nextJob = 0;
+    data->finishedJobs = 0;
+    data->stopRequested = false;
+    for (int i = 1; i < threadCount; ++i)
+        data->threads.push_back(std::thread(&WorkerPool::work, this));
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        data->stopRequested = true;
+        data->jobCondition.notify_all();
+    }
+    for (std::vector<std::thread>::iterator thread = data->threads.begin(); thread != data->threads.end(); ++thread)
+        thread->join();
+    delete data;
+}
+
+int WorkerPool::getThreadCount() const {
+    return (int) data->threads.size()+1;
+}
+
+void WorkerPool::run(int jobCount, const std::function<void(int)> &job) {
+    if (jobCount <= 0)
+        return;
+    std::lock_guard<std::mutex> runLock(data->runMutex);
+    std::unique_lock<std::mutex> lock(data->mutex);
+    data->job = &job;
+    data->jobCount = jobCount;
+    data->nextJob = 0;
+    data->finishedJobs = 0;
+    data->jobCondition.notify_all();
+    performJobs(lock);
+    while (data->finishedJobs < data->jobCount)
+        data->finishedCondition.wait(lock);
+    data->job = NULL;
+    data->jobCount = 0;
+    data->nextJob = 0;
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> lock(data->mutex);
+    while (!data->stopRequested) {
+        performJobs(lock);
+        data->jobCondition.wait(lock);
+    }
+}
+
+void WorkerPool::performJobs(std::unique_lock<std::mutex> &lock) {
+    while (data->nextJob < data->jobCount) {
+        int jobIndex = data->nextJob++;
+        const std::function<void(int)> *job = data->job;
+        lock.unlock();
+        (*job)(jobIndex);
+        lock.lock();
+        if (++data->finishedJobs == data->jobCount)
+            data->finishedCondition.notify_all();
+    }
+}
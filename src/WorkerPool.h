@@ -0,0 +1,28 @@
+
+#pragma once
+
+#include <functional>
+#include <mutex>
+
+/// A pool of threads that execute batches of independent jobs in parallel
+class WorkerPool {
+
+public:
+    /// Creates a pool with the given total number of threads (including the calling thread). Zero selects the number of CPU cores.
+    explicit WorkerPool(int threadCount = 0);
+    WorkerPool(const WorkerPool &) = delete;
+    ~WorkerPool();
+    WorkerPool & operator=(const WorkerPool &) = delete;
+    int getThreadCount() const;
+    /// Calls job(i) for each i from 0 to jobCount-1 and waits until all of them finish. The calling thread takes part in the work. Batches run by concurrent callers are executed one after another.
+    void run(int jobCount, const std::function<void(int)> &job);
+
+private:
+    struct WorkerPoolData;
+
+    WorkerPoolData *data;
+
+    void work();
+    void performJobs(std::unique_lock<std::mutex> &lock);
+
+};
@@ -0,0 +1,705 @@
+
+#include "colorConversion.h"
+
+#include <cstring>
+#include <cmath>
+extern "C" {
+    #include <libavutil/pixfmt.h>
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    #define X86_SIMD
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+    #define NEON_SIMD
+    #include <arm_neon.h>
+#endif
+
+// MSVC accepts intrinsics of any instruction set, GCC and Clang have to be told per function
+#if defined(X86_SIMD) && defined(__GNUC__)
+    #define TARGET(isa) __attribute__((target(isa)))
+#else
+    #define TARGET(isa)
+#endif
+
+// Number of fractional bits of the fixed-point YUV to RGB coefficients
+#define COEFFICIENT_BITS 13
+// Number of fractional bits of the fixed-point RGB to YUV coefficients
+#define RGB_COEFFICIENT_BITS 15
+
+enum SimdLevel {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_NEON
+};
+
+enum SourceLayout {
+    PLANAR8,
+    SEMIPLANAR8,
+    PLANAR10
+};
+
+/// Fixed-point coefficients applied to samples scaled to 14 bits (8-bit value << 6)
+struct YuvCoefficients {
+    int16_t yOffset, yScale;
+    int16_t vr, ug, vg, ub;
+};
+
+/// Fixed-point coefficients of the R, G, B (and zero alpha) components of each YUV component, repeated for two pixels
+struct RgbCoefficients {
+    int16_t y[8], u[8], v[8];
+    int yBias;
+};
+
+/// Source rows of a single output row. For semi-planar layout, u points to the interleaved chroma samples.
+struct YuvRow {
+    const uint8_t *y, *u, *v;
+};
+
+static SimdLevel detectSimd() {
+#if defined(X86_SIMD) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3]&1<<26) != 0;
+    bool avx = (info[2]&1<<27) && (info[2]&1<<28) && (_xgetbv(0)&6) == 6;
+    if (avx && maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        if (info[1]&1<<5)
+            return SIMD_AVX2;
+    }
+    return sse2 ? SIMD_SSE2 : SIMD_NONE;
+#elif defined(X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return __builtin_cpu_supports("sse2") ? SIMD_SSE2 : SIMD_NONE;
+#elif defined(NEON_SIMD)
+    return SIMD_NEON;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+static SimdLevel simdLevel() {
+    static const SimdLevel level = detectSimd();
+    return level;
+}
+
+static int16_t fixedPoint(double x) {
+    return (int16_t) floor(x*(1<<COEFFICIENT_BITS)+.5);
+}
+
+static YuvCoefficients yuvCoefficients(YuvMatrix matrix, bool fullRange) {
+    double kr = matrix == BT709 ? .2126 : .299;
+    double kb = matrix == BT709 ? .0722 : .114;
+    double kg = 1.-kr-kb;
+    double chromaScale = fullRange ? 1. : 255./224.;
+    YuvCoefficients c;
+    c.yOffset = fullRange ? 0 : 16<<6;
+    c.yScale = fixedPoint(fullRange ? 1. : 255./219.);
+    c.vr = fixedPoint(2.*(1.-kr)*chromaScale);
+    c.ug = fixedPoint(2.*(1.-kb)*kb/kg*chromaScale);
+    c.vg = fixedPoint(2.*(1.-kr)*kr/kg*chromaScale);
+    c.ub = fixedPoint(2.*(1.-kb)*chromaScale);
+    return c;
+}
+
+static RgbCoefficients rgbCoefficients(YuvMatrix matrix, bool fullRange) {
+    double kr = matrix == BT709 ? .2126 : .299;
+    double kb = matrix == BT709 ? .0722 : .114;
+    double kg = 1.-kr-kb;
+    double lumaScale = fullRange ? 1. : 219./255.;
+    double chromaScale = fullRange ? 1. : 224./255.;
+    double y[3] = { kr*lumaScale, kg*lumaScale, kb*lumaScale };
+    double u[3] = { -.5*kr/(1.-kb)*chromaScale, -.5*kg/(1.-kb)*chromaScale, .5*chromaScale };
+    double v[3] = { .5*chromaScale, -.5*kg/(1.-kr)*chromaScale, -.5*kb/(1.-kr)*chromaScale };
+    RgbCoefficients c;
+    for (int i = 0; i < 8; ++i) {
+        int component = i&3;
+        c.y[i] = component < 3 ? (int16_t) floor(y[component]*(1<<RGB_COEFFICIENT_BITS)+.5) : 0;
+        c.u[i] = component < 3 ? (int16_t) floor(u[component]*(1<<RGB_COEFFICIENT_BITS)+.5) : 0;
+        c.v[i] = component < 3 ? (int16_t) floor(v[component]*(1<<RGB_COEFFICIENT_BITS)+.5) : 0;
+    }
+    c.yBias = (fullRange ? 0 : 16<<RGB_COEFFICIENT_BITS)+(1<<(RGB_COEFFICIENT_BITS-1));
+    return c;
+}
+
+/// Rounding bias of chroma computed from the sum of 2^sumBits pixels
+static inline int chromaBias(int sumBits) {
+    return (128<<(RGB_COEFFICIENT_BITS+sumBits))+(1<<(RGB_COEFFICIENT_BITS+sumBits-1));
+}
+
+static inline uint8_t clampComponent(int x) {
+    x = (x+4)>>(16-COEFFICIENT_BITS);
+    return (uint8_t) (x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+// The SIMD variants compute exactly the same fixed-point expressions (except NEON which rounds the products differently)
+static void yuvRowScalar(uint8_t *dst, const YuvRow &row, SourceLayout layout, int begin, int end, const YuvCoefficients &c) {
+    for (int x = begin; x < end; ++x) {
+        int y, u, v;
+        switch (layout) {
+            case PLANAR8:
+                y = row.y[x]<<6;
+                u = row.u[x>>1]<<6;
+                v = row.v[x>>1]<<6;
+                break;
+            case SEMIPLANAR8:
+                y = row.y[x]<<6;
+                u = row.u[x&~1]<<6;
+                v = row.u[x|1]<<6;
+                break;
+            default:
+                y = reinterpret_cast<const uint16_t *>(row.y)[x]<<4;
+                u = reinterpret_cast<const uint16_t *>(row.u)[x>>1]<<4;
+                v = reinterpret_cast<const uint16_t *>(row.v)[x>>1]<<4;
+        }
+        y = ((y-c.yOffset)*c.yScale)>>16;
+        u -= 128<<6;
+        v -= 128<<6;
+        dst[4*x] = clampComponent(y+((v*c.vr)>>16));
+        dst[4*x+1] = clampComponent(y-((u*c.ug)>>16)-((v*c.vg)>>16));
+        dst[4*x+2] = clampComponent(y+((u*c.ub)>>16));
+        dst[4*x+3] = 0xff;
+    }
+}
+
+static inline uint8_t clampByte(int x) {
+    return (uint8_t) (x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+static inline int dotRgb(const int16_t *coefficients, int r, int g, int b) {
+    return coefficients[0]*r+coefficients[1]*g+coefficients[2]*b;
+}
+
+// Converts source rows a and b into luma rows y0 and y1 (y1 may be NULL) and a row of 2x2 averaged chroma
+static void rgbaRows420Scalar(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *a, const uint8_t *b, int begin, int end, const RgbCoefficients &c) {
+    for (int x = begin; x < end; x += 2) {
+        int x1 = x+1 < end ? x+1 : x;
+        const uint8_t *p[4] = { a+4*x, a+4*x1, b+4*x, b+4*x1 };
+        y0[x] = clampByte((dotRgb(c.y, p[0][0], p[0][1], p[0][2])+c.yBias)>>RGB_COEFFICIENT_BITS);
+        y0[x1] = clampByte((dotRgb(c.y, p[1][0], p[1][1], p[1][2])+c.yBias)>>RGB_COEFFICIENT_BITS);
+        if (y1) {
+            y1[x] = clampByte((dotRgb(c.y, p[2][0], p[2][1], p[2][2])+c.yBias)>>RGB_COEFFICIENT_BITS);
+            y1[x1] = clampByte((dotRgb(c.y, p[3][0], p[3][1], p[3][2])+c.yBias)>>RGB_COEFFICIENT_BITS);
+        }
+        int r = p[0][0]+p[1][0]+p[2][0]+p[3][0];
+        int g = p[0][1]+p[1][1]+p[2][1]+p[3][1];
+        int bl = p[0][2]+p[1][2]+p[2][2]+p[3][2];
+        u[x>>1] = clampByte((dotRgb(c.u, r, g, bl)+chromaBias(2))>>(RGB_COEFFICIENT_BITS+2));
+        v[x>>1] = clampByte((dotRgb(c.v, r, g, bl)+chromaBias(2))>>(RGB_COEFFICIENT_BITS+2));
+    }
+}
+
+static void rgbaRow444Scalar(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *a, int begin, int end, const RgbCoefficients &c) {
+    for (int x = begin; x < end; ++x) {
+        const uint8_t *p = a+4*x;
+        y[x] = clampByte((dotRgb(c.y, p[0], p[1], p[2])+c.yBias)>>RGB_COEFFICIENT_BITS);
+        u[x] = clampByte((dotRgb(c.u, p[0], p[1], p[2])+chromaBias(0))>>RGB_COEFFICIENT_BITS);
+        v[x] = clampByte((dotRgb(c.v, p[0], p[1], p[2])+chromaBias(0))>>RGB_COEFFICIENT_BITS);
+    }
+}
+
+#ifdef X86_SIMD
+
+// Adds the two partial products of each pixel produced by pmaddwd, resulting in four pixels from a and b
+TARGET("sse2") static inline __m128i addPixelPairs(__m128i a, __m128i b) {
+    __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// Computes one component of four RGBA pixels
+TARGET("sse2") static inline __m128i dotRgbSse2(__m128i pixels, __m128i coefficients, __m128i bias, __m128i shift) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefficients);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefficients);
+    return _mm_sra_epi32(_mm_add_epi32(addPixelPairs(lo, hi), bias), shift);
+}
+
+// Sums each 2x2 block of four RGBA pixels from rows a and b into two 16-bit RGBA sums
+TARGET("sse2") static inline __m128i sumBlocksSse2(__m128i a, __m128i b) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_add_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+TARGET("sse2") static int rgbaRows420Sse2(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *a, const uint8_t *b, int width, const RgbCoefficients &c) {
+    const __m128i yc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.y));
+    const __m128i uc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.u));
+    const __m128i vc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.v));
+    const __m128i yBias = _mm_set1_epi32(c.yBias), cBias = _mm_set1_epi32(chromaBias(2));
+    const __m128i yShift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS), cShift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS+2);
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a+4*x));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a+4*x+16));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b+4*x));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b+4*x+16));
+        __m128i luma = _mm_packs_epi32(dotRgbSse2(a0, yc, yBias, yShift), dotRgbSse2(a1, yc, yBias, yShift));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(y0+x), _mm_packus_epi16(luma, luma));
+        if (y1) {
+            luma = _mm_packs_epi32(dotRgbSse2(b0, yc, yBias, yShift), dotRgbSse2(b1, yc, yBias, yShift));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(y1+x), _mm_packus_epi16(luma, luma));
+        }
+        __m128i s0 = sumBlocksSse2(a0, b0), s1 = sumBlocksSse2(a1, b1);
+        __m128i cu = _mm_sra_epi32(_mm_add_epi32(addPixelPairs(_mm_madd_epi16(s0, uc), _mm_madd_epi16(s1, uc)), cBias), cShift);
+        __m128i cv = _mm_sra_epi32(_mm_add_epi32(addPixelPairs(_mm_madd_epi16(s0, vc), _mm_madd_epi16(s1, vc)), cBias), cShift);
+        __m128i chroma = _mm_packs_epi32(cu, cv);
+        chroma = _mm_packus_epi16(chroma, chroma);
+        int32_t u4 = _mm_cvtsi128_si32(chroma), v4 = _mm_cvtsi128_si32(_mm_srli_si128(chroma, 4));
+        memcpy(u+(x>>1), &u4, 4);
+        memcpy(v+(x>>1), &v4, 4);
+    }
+    return x;
+}
+
+TARGET("sse2") static int rgbaRow444Sse2(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *a, int width, const RgbCoefficients &c) {
+    const __m128i yc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.y));
+    const __m128i uc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.u));
+    const __m128i vc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c.v));
+    const __m128i yBias = _mm_set1_epi32(c.yBias), cBias = _mm_set1_epi32(chromaBias(0));
+    const __m128i shift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS);
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a+4*x));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a+4*x+16));
+        __m128i luma = _mm_packs_epi32(dotRgbSse2(a0, yc, yBias, shift), dotRgbSse2(a1, yc, yBias, shift));
+        __m128i cu = _mm_packs_epi32(dotRgbSse2(a0, uc, cBias, shift), dotRgbSse2(a1, uc, cBias, shift));
+        __m128i cv = _mm_packs_epi32(dotRgbSse2(a0, vc, cBias, shift), dotRgbSse2(a1, vc, cBias, shift));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(y+x), _mm_packus_epi16(luma, luma));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(u+x), _mm_packus_epi16(cu, cu));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(v+x), _mm_packus_epi16(cv, cv));
+    }
+    return x;
+}
+
+TARGET("avx2") static inline __m256i addPixelPairsAvx2(__m256i a, __m256i b) {
+    __m256 fa = _mm256_castsi256_ps(a), fb = _mm256_castsi256_ps(b);
+    return _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))), _mm256_castps_si256(_mm256_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// Computes one component of eight RGBA pixels, in order
+TARGET("avx2") static inline __m256i dotRgbAvx2(__m256i pixels, __m256i coefficients, __m256i bias, __m128i shift) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coefficients);
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coefficients);
+    return _mm256_sra_epi32(_mm256_add_epi32(addPixelPairsAvx2(lo, hi), bias), shift);
+}
+
+// Packs sixteen 32-bit components, as returned by two dotRgbAvx2 calls, into bytes
+TARGET("avx2") static inline __m128i packComponentsAvx2(__m256i a, __m256i b) {
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+}
+
+TARGET("avx2") static inline __m256i sumBlocksAvx2(__m256i a, __m256i b) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm256_add_epi16(hi, _mm256_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm256_unpacklo_epi64(lo, hi);
+}
+
+TARGET("avx2") static int rgbaRows420Avx2(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *a, const uint8_t *b, int width, const RgbCoefficients &c) {
+    const __m256i yc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.y)));
+    const __m256i uc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.u)));
+    const __m256i vc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.v)));
+    const __m256i yBias = _mm256_set1_epi32(c.yBias), cBias = _mm256_set1_epi32(chromaBias(2));
+    const __m128i yShift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS), cShift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS+2);
+    // Block sums come out as 0, 1, 4, 5 in the low and 2, 3, 6, 7 in the high lane
+    const __m256i blockOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    int x = 0;
+    for (; x+16 <= width; x += 16) {
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+4*x));
+        __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+4*x+32));
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b+4*x));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b+4*x+32));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y0+x), packComponentsAvx2(dotRgbAvx2(a0, yc, yBias, yShift), dotRgbAvx2(a1, yc, yBias, yShift)));
+        if (y1)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(y1+x), packComponentsAvx2(dotRgbAvx2(b0, yc, yBias, yShift), dotRgbAvx2(b1, yc, yBias, yShift)));
+        __m256i s0 = sumBlocksAvx2(a0, b0), s1 = sumBlocksAvx2(a1, b1);
+        __m256i cu = _mm256_sra_epi32(_mm256_add_epi32(addPixelPairsAvx2(_mm256_madd_epi16(s0, uc), _mm256_madd_epi16(s1, uc)), cBias), cShift);
+        __m256i cv = _mm256_sra_epi32(_mm256_add_epi32(addPixelPairsAvx2(_mm256_madd_epi16(s0, vc), _mm256_madd_epi16(s1, vc)), cBias), cShift);
+        cu = _mm256_permutevar8x32_epi32(cu, blockOrder);
+        cv = _mm256_permutevar8x32_epi32(cv, blockOrder);
+        __m128i chroma = _mm_packus_epi16(_mm_packs_epi32(_mm256_castsi256_si128(cu), _mm256_extracti128_si256(cu, 1)), _mm_packs_epi32(_mm256_castsi256_si128(cv), _mm256_extracti128_si256(cv, 1)));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(u+(x>>1)), chroma);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(v+(x>>1)), _mm_srli_si128(chroma, 8));
+    }
+    return x;
+}
+
+TARGET("avx2") static int rgbaRow444Avx2(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *a, int width, const RgbCoefficients &c) {
+    const __m256i yc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.y)));
+    const __m256i uc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.u)));
+    const __m256i vc = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c.v)));
+    const __m256i yBias = _mm256_set1_epi32(c.yBias), cBias = _mm256_set1_epi32(chromaBias(0));
+    const __m128i shift = _mm_cvtsi32_si128(RGB_COEFFICIENT_BITS);
+    int x = 0;
+    for (; x+16 <= width; x += 16) {
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+4*x));
+        __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+4*x+32));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y+x), packComponentsAvx2(dotRgbAvx2(a0, yc, yBias, shift), dotRgbAvx2(a1, yc, yBias, shift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(u+x), packComponentsAvx2(dotRgbAvx2(a0, uc, cBias, shift), dotRgbAvx2(a1, uc, cBias, shift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(v+x), packComponentsAvx2(dotRgbAvx2(a0, vc, cBias, shift), dotRgbAvx2(a1, vc, cBias, shift)));
+    }
+    return x;
+}
+
+TARGET("sse2") static int yuvRowSse2(uint8_t *dst, const YuvRow &row, SourceLayout layout, int width, const YuvCoefficients &c) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lowBytes = _mm_set1_epi16(0xff);
+    const __m128i alpha = _mm_set1_epi16(0xff);
+    const __m128i chromaOffset = _mm_set1_epi16(128<<6);
+    const __m128i rounding = _mm_set1_epi16(4);
+    const __m128i yOffset = _mm_set1_epi16(c.yOffset), yScale = _mm_set1_epi16(c.yScale);
+    const __m128i vr = _mm_set1_epi16(c.vr), ug = _mm_set1_epi16(c.ug), vg = _mm_set1_epi16(c.vg), ub = _mm_set1_epi16(c.ub);
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        __m128i y, u, v;
+        switch (layout) {
+            case PLANAR8: {
+                int32_t u4, v4;
+                memcpy(&u4, row.u+(x>>1), 4);
+                memcpy(&v4, row.v+(x>>1), 4);
+                y = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.y+x)), zero);
+                u = _mm_cvtsi32_si128(u4);
+                v = _mm_cvtsi32_si128(v4);
+                u = _mm_unpacklo_epi8(_mm_unpacklo_epi8(u, u), zero);
+                v = _mm_unpacklo_epi8(_mm_unpacklo_epi8(v, v), zero);
+                y = _mm_slli_epi16(y, 6);
+                u = _mm_slli_epi16(u, 6);
+                v = _mm_slli_epi16(v, 6);
+                break;
+            }
+            case SEMIPLANAR8: {
+                __m128i uv = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.u+x));
+                y = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.y+x)), zero);
+                u = _mm_and_si128(uv, lowBytes);
+                v = _mm_srli_epi16(uv, 8);
+                u = _mm_unpacklo_epi16(u, u);
+                v = _mm_unpacklo_epi16(v, v);
+                y = _mm_slli_epi16(y, 6);
+                u = _mm_slli_epi16(u, 6);
+                v = _mm_slli_epi16(v, 6);
+                break;
+            }
+            default:
+                y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row.y+2*x));
+                u = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.u+x));
+                v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.v+x));
+                u = _mm_unpacklo_epi16(u, u);
+                v = _mm_unpacklo_epi16(v, v);
+                y = _mm_slli_epi16(y, 4);
+                u = _mm_slli_epi16(u, 4);
+                v = _mm_slli_epi16(v, 4);
+        }
+        y = _mm_mulhi_epi16(_mm_sub_epi16(y, yOffset), yScale);
+        u = _mm_sub_epi16(u, chromaOffset);
+        v = _mm_sub_epi16(v, chromaOffset);
+        __m128i r = _mm_add_epi16(y, _mm_mulhi_epi16(v, vr));
+        __m128i g = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(u, ug)), _mm_mulhi_epi16(v, vg));
+        __m128i b = _mm_add_epi16(y, _mm_mulhi_epi16(u, ub));
+        r = _mm_srai_epi16(_mm_add_epi16(r, rounding), 16-COEFFICIENT_BITS);
+        g = _mm_srai_epi16(_mm_add_epi16(g, rounding), 16-COEFFICIENT_BITS);
+        b = _mm_srai_epi16(_mm_add_epi16(b, rounding), 16-COEFFICIENT_BITS);
+        __m128i rg = _mm_packus_epi16(r, g);
+        __m128i ba = _mm_packus_epi16(b, alpha);
+        __m128i rb = _mm_unpacklo_epi8(rg, ba);
+        __m128i ga = _mm_unpackhi_epi8(rg, ba);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst+4*x), _mm_unpacklo_epi8(rb, ga));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst+4*x+16), _mm_unpackhi_epi8(rb, ga));
+    }
+    return x;
+}
+
+TARGET("avx2") static int yuvRowAvx2(uint8_t *dst, const YuvRow &row, SourceLayout layout, int width, const YuvCoefficients &c) {
+    const __m128i lowBytes = _mm_set1_epi16(0xff);
+    const __m256i alpha = _mm256_set1_epi16(0xff);
+    const __m256i chromaOffset = _mm256_set1_epi16(128<<6);
+    const __m256i rounding = _mm256_set1_epi16(4);
+    const __m256i yOffset = _mm256_set1_epi16(c.yOffset), yScale = _mm256_set1_epi16(c.yScale);
+    const __m256i vr = _mm256_set1_epi16(c.vr), ug = _mm256_set1_epi16(c.ug), vg = _mm256_set1_epi16(c.vg), ub = _mm256_set1_epi16(c.ub);
+    int x = 0;
+    for (; x+16 <= width; x += 16) {
+        __m256i y, u, v;
+        switch (layout) {
+            case PLANAR8: {
+                __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.u+(x>>1)));
+                __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row.v+(x>>1)));
+                y = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row.y+x)));
+                u = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8));
+                v = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8));
+                y = _mm256_slli_epi16(y, 6);
+                u = _mm256_slli_epi16(u, 6);
+                v = _mm256_slli_epi16(v, 6);
+                break;
+            }
+            case SEMIPLANAR8: {
+                __m128i uv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row.u+x));
+                y = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row.y+x)));
+                // Widening each 16-bit sample to 32 bits and copying it into the upper half duplicates it in place
+                u = _mm256_cvtepu16_epi32(_mm_and_si128(uv, lowBytes));
+                v = _mm256_cvtepu16_epi32(_mm_srli_epi16(uv, 8));
+                u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+                v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+                y = _mm256_slli_epi16(y, 6);
+                u = _mm256_slli_epi16(u, 6);
+                v = _mm256_slli_epi16(v, 6);
+                break;
+            }
+            default:
+                y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row.y+2*x));
+                u = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row.u+x)));
+                v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row.v+x)));
+                u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+                v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+                y = _mm256_slli_epi16(y, 4);
+                u = _mm256_slli_epi16(u, 4);
+                v = _mm256_slli_epi16(v, 4);
+        }
+        y = _mm256_mulhi_epi16(_mm256_sub_epi16(y, yOffset), yScale);
+        u = _mm256_sub_epi16(u, chromaOffset);
+        v = _mm256_sub_epi16(v, chromaOffset);
+        __m256i r = _mm256_add_epi16(y, _mm256_mulhi_epi16(v, vr));
+        __m256i g = _mm256_sub_epi16(_mm256_sub_epi16(y, _mm256_mulhi_epi16(u, ug)), _mm256_mulhi_epi16(v, vg));
+        __m256i b = _mm256_add_epi16(y, _mm256_mulhi_epi16(u, ub));
+        r = _mm256_srai_epi16(_mm256_add_epi16(r, rounding), 16-COEFFICIENT_BITS);
+        g = _mm256_srai_epi16(_mm256_add_epi16(g, rounding), 16-COEFFICIENT_BITS);
+        b = _mm256_srai_epi16(_mm256_add_epi16(b, rounding), 16-COEFFICIENT_BITS);
+        // Packing and unpacking operate within 128-bit lanes, which hold pixels 0-3 & 8-11 and 4-7 & 12-15 in the end
+        __m256i rg = _mm256_packus_epi16(r, g);
+        __m256i ba = _mm256_packus_epi16(b, alpha);
+        __m256i rb = _mm256_unpacklo_epi8(rg, ba);
+        __m256i ga = _mm256_unpackhi_epi8(rg, ba);
+        __m256i lo = _mm256_unpacklo_epi8(rb, ga);
+        __m256i hi = _mm256_unpackhi_epi8(rb, ga);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst+4*x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst+4*x+32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    return x;
+}
+
+#endif
+
+#ifdef NEON_SIMD
+
+static int yuvRowNeon(uint8_t *dst, const YuvRow &row, SourceLayout layout, int width, const YuvCoefficients &c) {
+    const int16x8_t chromaOffset = vdupq_n_s16(128<<6);
+    const int16x8_t yOffset = vdupq_n_s16(c.yOffset), yScale = vdupq_n_s16(c.yScale);
+    const int16x8_t vr = vdupq_n_s16(c.vr), ug = vdupq_n_s16(c.ug), vg = vdupq_n_s16(c.vg), ub = vdupq_n_s16(c.ub);
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        int16x8_t y, u, v;
+        switch (layout) {
+            case PLANAR8: {
+                uint32_t u4, v4;
+                memcpy(&u4, row.u+(x>>1), 4);
+                memcpy(&v4, row.v+(x>>1), 4);
+                uint8x8_t u8 = vreinterpret_u8_u32(vdup_n_u32(u4));
+                uint8x8_t v8 = vreinterpret_u8_u32(vdup_n_u32(v4));
+                y = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(row.y+x), 6));
+                u = vreinterpretq_s16_u16(vshll_n_u8(vzip_u8(u8, u8).val[0], 6));
+                v = vreinterpretq_s16_u16(vshll_n_u8(vzip_u8(v8, v8).val[0], 6));
+                break;
+            }
+            case SEMIPLANAR8: {
+                uint8x8_t uv = vld1_u8(row.u+x);
+                uint8x8x2_t planes = vuzp_u8(uv, uv);
+                y = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(row.y+x), 6));
+                u = vreinterpretq_s16_u16(vshll_n_u8(vzip_u8(planes.val[0], planes.val[0]).val[0], 6));
+                v = vreinterpretq_s16_u16(vshll_n_u8(vzip_u8(planes.val[1], planes.val[1]).val[0], 6));
+                break;
+            }
+            default: {
+                uint16x4_t u4 = vld1_u16(reinterpret_cast<const uint16_t *>(row.u)+(x>>1));
+                uint16x4_t v4 = vld1_u16(reinterpret_cast<const uint16_t *>(row.v)+(x>>1));
+                uint16x4x2_t uu = vzip_u16(u4, u4), vv = vzip_u16(v4, v4);
+                y = vreinterpretq_s16_u16(vshlq_n_u16(vld1q_u16(reinterpret_cast<const uint16_t *>(row.y)+x), 4));
+                u = vreinterpretq_s16_u16(vshlq_n_u16(vcombine_u16(uu.val[0], uu.val[1]), 4));
+                v = vreinterpretq_s16_u16(vshlq_n_u16(vcombine_u16(vv.val[0], vv.val[1]), 4));
+            }
+        }
+        // vqdmulh doubles the product, so the results have one more fractional bit than in the x86 variants
+        y = vqdmulhq_s16(vsubq_s16(y, yOffset), yScale);
+        u = vsubq_s16(u, chromaOffset);
+        v = vsubq_s16(v, chromaOffset);
+        uint8x8x4_t pixels;
+        pixels.val[0] = vqrshrun_n_s16(vaddq_s16(y, vqdmulhq_s16(v, vr)), 17-COEFFICIENT_BITS);
+        pixels.val[1] = vqrshrun_n_s16(vsubq_s16(vsubq_s16(y, vqdmulhq_s16(u, ug)), vqdmulhq_s16(v, vg)), 17-COEFFICIENT_BITS);
+        pixels.val[2] = vqrshrun_n_s16(vaddq_s16(y, vqdmulhq_s16(u, ub)), 17-COEFFICIENT_BITS);
+        pixels.val[3] = vdup_n_u8(0xff);
+        vst4_u8(dst+4*x, pixels);
+    }
+    return x;
+}
+
+// Computes one component of eight pixels given as separate 16-bit R, G, B vectors
+static inline uint8x8_t dotRgbNeon(int16x8_t r, int16x8_t g, int16x8_t b, const int16_t *coefficients, int bias, int shift) {
+    int32x4_t lo = vdupq_n_s32(bias), hi = vdupq_n_s32(bias);
+    lo = vmlal_n_s16(lo, vget_low_s16(r), coefficients[0]);
+    hi = vmlal_n_s16(hi, vget_high_s16(r), coefficients[0]);
+    lo = vmlal_n_s16(lo, vget_low_s16(g), coefficients[1]);
+    hi = vmlal_n_s16(hi, vget_high_s16(g), coefficients[1]);
+    lo = vmlal_n_s16(lo, vget_low_s16(b), coefficients[2]);
+    hi = vmlal_n_s16(hi, vget_high_s16(b), coefficients[2]);
+    int32x4_t shiftRight = vdupq_n_s32(-shift);
+    return vqmovun_s16(vcombine_s16(vqmovn_s32(vshlq_s32(lo, shiftRight)), vqmovn_s32(vshlq_s32(hi, shiftRight))));
+}
+
+static inline int16x8_t widenNeon(uint8x8_t x) {
+    return vreinterpretq_s16_u16(vmovl_u8(x));
+}
+
+static int rgbaRows420Neon(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *a, const uint8_t *b, int width, const RgbCoefficients &c) {
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        uint8x8x4_t pa = vld4_u8(a+4*x), pb = vld4_u8(b+4*x);
+        vst1_u8(y0+x, dotRgbNeon(widenNeon(pa.val[0]), widenNeon(pa.val[1]), widenNeon(pa.val[2]), c.y, c.yBias, RGB_COEFFICIENT_BITS));
+        if (y1)
+            vst1_u8(y1+x, dotRgbNeon(widenNeon(pb.val[0]), widenNeon(pb.val[1]), widenNeon(pb.val[2]), c.y, c.yBias, RGB_COEFFICIENT_BITS));
+        // Vertical sums of the two rows, then horizontal sums of adjacent pixels (the upper half repeats the lower one)
+        int16x8_t sums[3];
+        for (int i = 0; i < 3; ++i) {
+            uint16x8_t column = vaddl_u8(pa.val[i], pb.val[i]);
+            uint16x4_t blocks = vpadd_u16(vget_low_u16(column), vget_high_u16(column));
+            sums[i] = vreinterpretq_s16_u16(vcombine_u16(blocks, blocks));
+        }
+        uint32_t u4 = vget_lane_u32(vreinterpret_u32_u8(dotRgbNeon(sums[0], sums[1], sums[2], c.u, chromaBias(2), RGB_COEFFICIENT_BITS+2)), 0);
+        uint32_t v4 = vget_lane_u32(vreinterpret_u32_u8(dotRgbNeon(sums[0], sums[1], sums[2], c.v, chromaBias(2), RGB_COEFFICIENT_BITS+2)), 0);
+        memcpy(u+(x>>1), &u4, 4);
+        memcpy(v+(x>>1), &v4, 4);
+    }
+    return x;
+}
+
+static int rgbaRow444Neon(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *a, int width, const RgbCoefficients &c) {
+    int x = 0;
+    for (; x+8 <= width; x += 8) {
+        uint8x8x4_t pa = vld4_u8(a+4*x);
+        int16x8_t r = widenNeon(pa.val[0]), g = widenNeon(pa.val[1]), b = widenNeon(pa.val[2]);
+        vst1_u8(y+x, dotRgbNeon(r, g, b, c.y, c.yBias, RGB_COEFFICIENT_BITS));
+        vst1_u8(u+x, dotRgbNeon(r, g, b, c.u, chromaBias(0), RGB_COEFFICIENT_BITS));
+        vst1_u8(v+x, dotRgbNeon(r, g, b, c.v, chromaBias(0), RGB_COEFFICIENT_BITS));
+    }
+    return x;
+}
+
+#endif
+
+bool yuvToRgbaFlipped(uint8_t *dst, int dstLinesize, const uint8_t *const src[], const int srcLinesize[], int pixFmt, int width, int height, YuvMatrix matrix, bool fullRange) {
+    SourceLayout layout;
+    switch (pixFmt) {
+        case AV_PIX_FMT_YUVJ420P:
+            fullRange = true;
+            // fallthrough
+        case AV_PIX_FMT_YUV420P:
+            layout = PLANAR8;
+            break;
+        case AV_PIX_FMT_NV12:
+            layout = SEMIPLANAR8;
+            break;
+        case AV_PIX_FMT_YUV420P10:
+            layout = PLANAR10;
+            break;
+        default:
+            return false;
+    }
+    SimdLevel simd = simdLevel();
+    if (simd == SIMD_NONE)
+        return false;
+    YuvCoefficients c = yuvCoefficients(matrix, fullRange);
+    for (int i = 0; i < height; ++i) {
+        YuvRow row;
+        row.y = src[0]+(ptrdiff_t) srcLinesize[0]*i;
+        row.u = src[1]+(ptrdiff_t) srcLinesize[1]*(i>>1);
+        row.v = layout == SEMIPLANAR8 ? NULL : src[2]+(ptrdiff_t) srcLinesize[2]*(i>>1);
+        uint8_t *dstRow = dst+(ptrdiff_t) dstLinesize*(height-1-i);
+        int x = 0;
+        switch (simd) {
+#ifdef X86_SIMD
+            case SIMD_AVX2:
+                x = yuvRowAvx2(dstRow, row, layout, width, c);
+                break;
+            case SIMD_SSE2:
+                x = yuvRowSse2(dstRow, row, layout, width, c);
+                break;
+#endif
+#ifdef NEON_SIMD
+            case SIMD_NEON:
+                x = yuvRowNeon(dstRow, row, layout, width, c);
+                break;
+#endif
+            default:
+                break;
+        }
+        yuvRowScalar(dstRow, row, layout, x, width, c);
+    }
+    return true;
+}
+
+/// Converts to YUV using the given instruction set, SIMD_NONE converts by the scalar code alone
+static bool rgbaFlippedToYuvSimd(SimdLevel simd, uint8_t *const dst[], const int dstLinesize[], const uint8_t *src, int srcLinesize, int pixFmt, int width, int height, YuvMatrix matrix, bool fullRange) {
+    bool subsampled;
+    switch (pixFmt) {
+        case AV_PIX_FMT_YUV420P:
+            subsampled = true;
+            break;
+        case AV_PIX_FMT_YUV444P:
+            subsampled = false;
+            break;
+        default:
+            return false;
+    }
+    RgbCoefficients c = rgbCoefficients(matrix, fullRange);
+    int rowStep = subsampled ? 2 : 1;
+    for (int i = 0; i < height; i += rowStep) {
+        const uint8_t *a = src+(ptrdiff_t) srcLinesize*(height-1-i);
+        // The last row of an odd height is averaged with itself
+        const uint8_t *b = subsampled && i+1 < height ? a-srcLinesize : a;
+        uint8_t *y0 = dst[0]+(ptrdiff_t) dstLinesize[0]*i;
+        uint8_t *y1 = subsampled && i+1 < height ? y0+dstLinesize[0] : NULL;
+        uint8_t *u = dst[1]+(ptrdiff_t) dstLinesize[1]*(i/rowStep);
+        uint8_t *v = dst[2]+(ptrdiff_t) dstLinesize[2]*(i/rowStep);
+        int x = 0;
+        switch (simd) {
+#ifdef X86_SIMD
+            case SIMD_AVX2:
+                x = subsampled ? rgbaRows420Avx2(y0, y1, u, v, a, b, width, c) : rgbaRow444Avx2(y0, u, v, a, width, c);
+                break;
+            case SIMD_SSE2:
+                x = subsampled ? rgbaRows420Sse2(y0, y1, u, v, a, b, width, c) : rgbaRow444Sse2(y0, u, v, a, width, c);
+                break;
+#endif
+#ifdef NEON_SIMD
+            case SIMD_NEON:
+                x = subsampled ? rgbaRows420Neon(y0, y1, u, v, a, b, width, c) : rgbaRow444Neon(y0, u, v, a, width, c);
+                break;
+#endif
+            default:
+                break;
+        }
+        if (subsampled)
+            rgbaRows420Scalar(y0, y1, u, v, a, b, x, width, c);
+        else
+            rgbaRow444Scalar(y0, u, v, a, x, width, c);
+    }
+    return true;
+}
+
+bool rgbaFlippedToYuv(uint8_t *const dst[], const int dstLinesize[], const uint8_t *src, int srcLinesize, int pixFmt, int width, int height, YuvMatrix matrix, bool fullRange) {
+    SimdLevel simd = simdLevel();
+    if (simd == SIMD_NONE)
+        return false;
+    return rgbaFlippedToYuvSimd(simd, dst, dstLinesize, src, srcLinesize, pixFmt, width, height, matrix, fullRange);
+}
@@ -0,0 +1,15 @@
+
+#pragma once
+
+#include <cstdint>
+
+/// YUV color matrices
+enum YuvMatrix {
+    BT601,
+    BT709
+};
+
+/// Converts an image in a YUV 4:2:0 pixel format (AVPixelFormat) to RGBA stored bottom-up, using SIMD instructions when the CPU supports them. Returns false if the pixel format or the CPU is not supported.
+bool yuvToRgbaFlipped(uint8_t *dst, int dstLinesize, const uint8_t *const src[], const int srcLinesize[], int pixFmt, int width, int height, YuvMatrix matrix, bool fullRange);
+/// Converts a bottom-up RGBA image to planar YUV 4:2:0 or 4:4:4 (AVPixelFormat), using SIMD instructions when the CPU supports them. Chroma of 4:2:0 is the average of 2x2 pixels. Returns false if the pixel format or the CPU is not supported.
+bool rgbaFlippedToYuv(uint8_t *const dst[], const int dstLinesize[], const uint8_t *src, int srcLinesize, int pixFmt, int width, int height, YuvMatrix matrix, bool fullRange);
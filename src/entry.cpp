@@ -15,6 +15,9 @@ struct ParseData {
     int initializer;
     int curArg;
     std::string filename;
+    VideoDecoder::ThreadingMode threading;
+    int threadCount;
+    bool scrub;
     int sourceId;
     Mp4ExportObject::Codec codec;
     Mp4ExportObject::PixelFormat pixelFormat;
@@ -83,7 +86,7 @@ int SHADRON_API_FN shadron_parse_initializer(void *context, int objectType, int
             if (objectType != SHADRON_FLAG_ANIMATION)
                 return SHADRON_RESULT_UNEXPECTED_ERROR;
             *parseContext = new ParseData { INITIALIZER_VIDEO_FILE_ID };
-            *firstArgumentTypes = SHADRON_ARG_NONE|SHADRON_ARG_FILENAME;
+            *firstArgumentTypes = SHADRON_ARG_NONE|SHADRON_ARG_FILENAME|SHADRON_ARG_KEYWORD;
             return SHADRON_RESULT_OK;
         case INITIALIZER_MP4_EXPORT_ID:
             if (objectType != SHADRON_FLAG_EXPORT)
@@ -102,10 +105,52 @@ int SHADRON_API_FN shadron_parse_initializer_argument(void *context, void *parse
     switch (pd->initializer) {
         case INITIALIZER_VIDEO_FILE_ID:
             switch (pd->curArg) {
-                case 0: // Input filename
-                    if (argumentType != SHADRON_ARG_FILENAME)
+                case 0: // Input filename (optional)
+                    if (argumentType == SHADRON_ARG_FILENAME) {
+                        pd->filename = reinterpret_cast<const char *>(argumentData);
+                        *nextArgumentTypes = SHADRON_ARG_NONE|SHADRON_ARG_KEYWORD;
+                        break;
+                    }
+                    ++pd->curArg;
+                case 1: // Decoder threading mode (optional)
+                    if (argumentType != SHADRON_ARG_KEYWORD)
                         return SHADRON_RESULT_UNEXPECTED_ERROR;
-                    pd->filename = reinterpret_cast<const char *>(argumentData);
+                    {
+                        std::string kw = reinterpret_cast<const char *>(argumentData);
+                        if (kw == "scrub") {
+                            pd->scrub = true;
+                            pd->curArg = 3;
+                            *nextArgumentTypes = SHADRON_ARG_NONE;
+                            break;
+                        }
+                        if (kw == "auto")
+                            pd->threading = VideoDecoder::AUTO;
+                        else if (kw == "single")
+                            pd->threading = VideoDecoder::SINGLE;
+                        else if (kw == "frame")
+                            pd->threading = VideoDecoder::FRAME;
+                        else if (kw == "slice")
+                            pd->threading = VideoDecoder::SLICE;
+                        else
+                            return SHADRON_RESULT_PARSE_ERROR;
+                    }
+                    *nextArgumentTypes = SHADRON_ARG_NONE|SHADRON_ARG_KEYWORD|(pd->threading != VideoDecoder::SINGLE ? SHADRON_ARG_INT : 0);
+                    break;
+                case 2: // Decoder thread count (optional)
+                    if (argumentType == SHADRON_ARG_INT) {
+                        pd->threadCount = *reinterpret_cast<const int *>(argumentData);
+                        if (pd->threadCount <= 0)
+                            return SHADRON_RESULT_PARSE_ERROR;
+                        *nextArgumentTypes = SHADRON_ARG_NONE|SHADRON_ARG_KEYWORD;
+                        break;
+                    }
+                    ++pd->curArg;
+                case 3: // Keyframe preview while scrubbing (optional)
+                    if (argumentType != SHADRON_ARG_KEYWORD)
+                        return SHADRON_RESULT_UNEXPECTED_ERROR;
+                    if (std::string(reinterpret_cast<const char *>(argumentData)) != "scrub")
+                        return SHADRON_RESULT_PARSE_ERROR;
+                    pd->scrub = true;
                     *nextArgumentTypes = SHADRON_ARG_NONE;
                     break;
                 default:
@@ -221,7 +266,7 @@ int SHADRON_API_FN shadron_parse_initializer_finish(void *context, void *parseCo
         if (obj) {
             switch (pd->initializer) {
                 case INITIALIZER_VIDEO_FILE_ID:
-                    reconfigure<VideoFileObject>(obj, pd->filename);
+                    reconfigure<VideoFileObject>(obj, pd->filename, pd->threading, pd->threadCount, pd->scrub);
                     break;
                 case INITIALIZER_MP4_EXPORT_ID:
                     reconfigure<Mp4ExportObject>(obj, pd->sourceId, pd->filename, pd->codec, pd->pixelFormat, pd->settings, pd->framerateExpr, pd->durationExpr, pd->framerate, pd->duration, pd->framerateSource, pd->durationSource);
@@ -233,7 +278,7 @@ int SHADRON_API_FN shadron_parse_initializer_finish(void *context, void *parseCo
         if (!obj) {
             switch (pd->initializer) {
                 case INITIALIZER_VIDEO_FILE_ID:
-                    obj = new VideoFileObject(name, pd->filename);
+                    obj = new VideoFileObject(name, ext->getVideoDecoderPool(), pd->filename, pd->threading, pd->threadCount, pd->scrub);
                     break;
                 case INITIALIZER_MP4_EXPORT_ID:
                     obj = new Mp4ExportObject(pd->sourceId, pd->filename, pd->codec, pd->pixelFormat, pd->settings, pd->framerateExpr, pd->durationExpr, pd->framerate, pd->duration, pd->framerateSource, pd->durationSource);
@@ -252,6 +297,19 @@ int SHADRON_API_FN shadron_parse_initializer_finish(void *context, void *parseCo
 int SHADRON_API_FN shadron_parse_error_length(void *context, void *parseContext, int *length, int encoding) {
     ParseData *pd = reinterpret_cast<ParseData *>(parseContext);
     switch (pd->initializer) {
+        case INITIALIZER_VIDEO_FILE_ID:
+            switch (pd->curArg) {
+                case 1: // Decoder threading mode
+                    *length = sizeof(ERROR_THREADING_KEYWORD)-1;
+                    return SHADRON_RESULT_OK;
+                case 2: // Decoder thread count
+                    *length = sizeof(ERROR_THREAD_COUNT_POSITIVE)-1;
+                    return SHADRON_RESULT_OK;
+                case 3: // Keyframe preview while scrubbing
+                    *length = sizeof(ERROR_SCRUB_KEYWORD)-1;
+                    return SHADRON_RESULT_OK;
+            }
+            return SHADRON_RESULT_NO_DATA;
         case INITIALIZER_MP4_EXPORT_ID:
             switch (pd->curArg) {
                 case 0: // Source animation name
@@ -288,6 +346,22 @@ int SHADRON_API_FN shadron_parse_error_string(void *context, void *parseContext,
     const char *errorString = NULL;
     int errorStrLen = 0;
     switch (pd->initializer) {
+        case INITIALIZER_VIDEO_FILE_ID:
+            switch (pd->curArg) {
+                case 1: // Decoder threading mode
+                    errorString = ERROR_THREADING_KEYWORD;
+                    errorStrLen = sizeof(ERROR_THREADING_KEYWORD)-1;
+                    break;
+                case 2: // Decoder thread count
+                    errorString = ERROR_THREAD_COUNT_POSITIVE;
+                    errorStrLen = sizeof(ERROR_THREAD_COUNT_POSITIVE)-1;
+                    break;
+                case 3: // Keyframe preview while scrubbing
+                    errorString = ERROR_SCRUB_KEYWORD;
+                    errorStrLen = sizeof(ERROR_SCRUB_KEYWORD)-1;
+                    break;
+            }
+            break;
         case INITIALIZER_MP4_EXPORT_ID:
             switch (pd->curArg) {
                 case 0: // Source animation name
@@ -388,6 +462,10 @@ int SHADRON_API_FN shadron_object_offer_source_pixels(void *context, void *objec
     LogicalObject *obj = reinterpret_cast<LogicalObject *>(object);
     if (obj->offerSource(sourceIndex)) {
         *format = SHADRON_FORMAT_RGBA_BYTE;
+        if (void *buffer = obj->getSourcePixelBuffer(sourceIndex, width, height)) {
+            *pixelBuffer = buffer;
+            *pixelsContext = buffer;
+        }
         return SHADRON_RESULT_OK;
     }
     return SHADRON_RESULT_IGNORE;
@@ -398,6 +476,8 @@ int SHADRON_API_FN shadron_object_post_source_pixels(void *context, void *object
     if (format != SHADRON_FORMAT_RGBA_BYTE)
         return SHADRON_RESULT_UNEXPECTED_ERROR;
     obj->setSourcePixels(sourceIndex, pixels, width, height);
+    if (pixelsContext)
+        obj->releaseSourcePixelBuffer(sourceIndex, pixelsContext);
     return SHADRON_RESULT_OK;
 }
 
@@ -423,12 +503,16 @@ int SHADRON_API_FN shadron_object_fetch_pixels(void *context, void *object, floa
     LogicalObject *obj = reinterpret_cast<LogicalObject *>(object);
     if (!obj->pixelsReady())
         return SHADRON_RESULT_NO_DATA;
-    if (!(*pixels = obj->fetchPixels(time, deltaTime, realTime != 0, width, height)))
+    *pixelsContext = NULL;
+    if (!(*pixels = obj->fetchPixels(time, deltaTime, realTime != 0, width, height, *pixelsContext)))
         return SHADRON_RESULT_NO_CHANGE;
     return SHADRON_RESULT_OK;
 }
 
 int SHADRON_API_FN shadron_object_release_pixels(void *context, void *object, void *pixelsContext) {
+    LogicalObject *obj = reinterpret_cast<LogicalObject *>(object);
+    if (pixelsContext)
+        obj->releasePixels(pixelsContext);
     return SHADRON_RESULT_OK;
 }
 
@@ -475,10 +559,23 @@ int SHADRON_API_FN shadron_export_finish(void *context, void *object, void *expo
     return SHADRON_RESULT_OK;
 }
 
+/// Translates a Shadron sample format to the output format of SoundDecoder
+static bool soundFormat(int format, SoundDecoder::Format &output) {
+    switch (format) {
+        case SHADRON_FORMAT_STEREO_INT16LE:
+            output = SoundDecoder::Format(SoundDecoder::INT16, 2);
+            return true;
+        default:
+            return false;
+    }
+}
+
 int SHADRON_API_FN shadron_decode_sound(void *context, const void *rawData, int rawLength, int *sampleRate, int *sampleCount, int *format, void **decoderContext) {
-    if (*format != SHADRON_FORMAT_STEREO_INT16LE)
+    SoundDecoder::Format outputFormat;
+    if (!soundFormat(*format, outputFormat))
         return SHADRON_RESULT_UNEXPECTED_ERROR;
-    SoundDecoder *decoder = SoundDecoder::decode(rawData, rawLength);
+    FfmpegExtension *ext = reinterpret_cast<FfmpegExtension *>(context);
+    SoundDecoder *decoder = SoundDecoder::decode(rawData, rawLength, outputFormat, ext->getWorkerPool(), ext->getSampleCacheWriter());
     if (decoder) {
         *sampleRate = decoder->getSampleRate();
         *sampleCount = decoder->getSampleCount();
@@ -490,13 +587,15 @@ int SHADRON_API_FN shadron_decode_sound(void *context, const void *rawData, int
 
 int SHADRON_API_FN shadron_decode_fetch_samples(void *context, void *decoderContext, const void *rawData, int rawLength, void *sampleBuffer, int sampleCount, int format) {
     SoundDecoder *decoder = reinterpret_cast<SoundDecoder *>(decoderContext);
-    if (format != SHADRON_FORMAT_STEREO_INT16LE) {
+    SoundDecoder::Format outputFormat;
+    if (!soundFormat(format, outputFormat) || !(outputFormat == decoder->getFormat())) {
         delete decoder;
         return SHADRON_RESULT_UNEXPECTED_ERROR;
     }
-    decoder->copyWaveform(sampleBuffer, sampleCount);
+    FfmpegExtension *ext = reinterpret_cast<FfmpegExtension *>(context);
+    bool ok = decoder->fetchWaveform(rawData, rawLength, sampleBuffer, sampleCount, ext->getWorkerPool());
     delete decoder;
-    return SHADRON_RESULT_OK;
+    return ok ? SHADRON_RESULT_OK : SHADRON_RESULT_FILE_FORMAT_ERROR;
 }
 
 int SHADRON_API_FN shadron_decode_discard(void *context, void *decoderContext) {
@@ -0,0 +1,67 @@
+
+#include "sampleConversion.h"
+
+#include <cstring>
+
+// SSE2 is part of x86-64 and merely interleaving samples does not benefit from wider vectors, so no runtime detection is needed
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define SSE2_SIMD
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+    #define NEON_SIMD
+    #include <arm_neon.h>
+#endif
+
+template <typename T>
+static void interleaveScalar(uint8_t *dst, const uint8_t *const src[], int channels, int begin, int end) {
+    T *output = reinterpret_cast<T *>(dst)+(size_t) channels*begin;
+    for (int i = begin; i < end; ++i) {
+        for (int c = 0; c < channels; ++c)
+            *output++ = reinterpret_cast<const T *>(src[c])[i];
+    }
+}
+
+/// Interleaves a prefix of the stereo samples, returns the number of samples processed
+static int interleaveStereoSimd(uint8_t *dst, const uint8_t *left, const uint8_t *right, int sampleSize, int samples) {
+    int i = 0;
+#if defined(SSE2_SIMD)
+    int step = 16/sampleSize;
+    for (; i+step <= samples; i += step) {
+        __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i *>(left+i*sampleSize));
+        __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(right+i*sampleSize));
+        __m128i *output = reinterpret_cast<__m128i *>(dst+2*i*sampleSize);
+        if (sampleSize == 2) {
+            _mm_storeu_si128(output, _mm_unpacklo_epi16(l, r));
+            _mm_storeu_si128(output+1, _mm_unpackhi_epi16(l, r));
+        } else {
+            _mm_storeu_si128(output, _mm_unpacklo_epi32(l, r));
+            _mm_storeu_si128(output+1, _mm_unpackhi_epi32(l, r));
+        }
+    }
+#elif defined(NEON_SIMD)
+    if (sampleSize == 2) {
+        for (; i+8 <= samples; i += 8) {
+            uint16x8x2_t lr = { { vld1q_u16(reinterpret_cast<const uint16_t *>(left)+i), vld1q_u16(reinterpret_cast<const uint16_t *>(right)+i) } };
+            vst2q_u16(reinterpret_cast<uint16_t *>(dst)+2*i, lr);
+        }
+    } else {
+        for (; i+4 <= samples; i += 4) {
+            uint32x4x2_t lr = { { vld1q_u32(reinterpret_cast<const uint32_t *>(left)+i), vld1q_u32(reinterpret_cast<const uint32_t *>(right)+i) } };
+            vst2q_u32(reinterpret_cast<uint32_t *>(dst)+2*i, lr);
+        }
+    }
+#endif
+    return i;
+}
+
+void interleaveSamples(uint8_t *dst, const uint8_t *const src[], int channels, int sampleSize, int samples) {
+    if (channels == 1) {
+        memcpy(dst, src[0], (size_t) sampleSize*samples);
+        return;
+    }
+    int begin = channels == 2 ? interleaveStereoSimd(dst, src[0], src[1], sampleSize, samples) : 0;
+    if (sampleSize == 2)
+        interleaveScalar<uint16_t>(dst, src, channels, begin, samples);
+    else
+        interleaveScalar<uint32_t>(dst, src, channels, begin, samples);
+}
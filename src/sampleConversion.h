@@ -0,0 +1,7 @@
+
+#pragma once
+
+#include <cstdint>
+
+/// Interleaves samples of separate channel planes into dst. Sample size must be 2 or 4 bytes. Stereo is converted with SIMD instructions when available.
+void interleaveSamples(uint8_t *dst, const uint8_t *const src[], int channels, int sampleSize, int samples);
@@ -0,0 +1,151 @@
+
+// Compares the SIMD and scalar paths of rgbaFlippedToYuv with each other and with swscale
+
+#include "../src/colorConversion.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+extern "C" {
+    #include <libswscale/swscale.h>
+}
+
+// Image size, which is not a multiple of the SIMD widths so that the scalar tails are covered too
+#define WIDTH 134
+#define HEIGHT 38
+// Maximum difference from swscale, whose rounding and chroma filtering differ slightly
+#define LUMA_TOLERANCE 1
+#define CHROMA_TOLERANCE 2
+
+/// Planar YUV image
+struct Image {
+    std::vector<uint8_t> planes[3];
+    int linesize[3];
+};
+
+static Image allocateImage(bool subsampled) {
+    Image image;
+    for (int i = 0; i < 3; ++i) {
+        int width = i && subsampled ? (WIDTH+1)/2 : WIDTH;
+        int height = i && subsampled ? (HEIGHT+1)/2 : HEIGHT;
+        image.linesize[i] = width;
+        image.planes[i].resize((size_t) width*height);
+    }
+    return image;
+}
+
+/// Random pixels, which expose any difference between the code paths
+static std::vector<uint8_t> noiseImage() {
+    std::vector<uint8_t> rgba(4*WIDTH*HEIGHT);
+    unsigned state = 12345;
+    for (size_t i = 0; i < rgba.size(); ++i) {
+        state = state*1103515245u+12345u;
+        rgba[i] = (uint8_t) (state>>23);
+    }
+    return rgba;
+}
+
+/// Slowly changing colors, on which differently filtered chroma of 4:2:0 stays close
+static std::vector<uint8_t> smoothImage() {
+    std::vector<uint8_t> rgba(4*WIDTH*HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            uint8_t *pixel = &rgba[4*(y*WIDTH+x)];
+            pixel[0] = (uint8_t) (128.+120.*sin(x/97.+y/61.));
+            pixel[1] = (uint8_t) (128.+120.*sin(x/71.-y/83.+2.));
+            pixel[2] = (uint8_t) (128.+120.*cos(x/89.+y/67.+1.));
+            pixel[3] = 255;
+        }
+    }
+    return rgba;
+}
+
+static bool convert(SimdLevel simd, const std::vector<uint8_t> &rgba, int pixFmt, YuvMatrix matrix, bool fullRange, Image &image) {
+    uint8_t *dst[3] = { &image.planes[0][0], &image.planes[1][0], &image.planes[2][0] };
+    return rgbaFlippedToYuvSimd(simd, dst, image.linesize, &rgba[0], 4*WIDTH, pixFmt, WIDTH, HEIGHT, matrix, fullRange);
+}
+
+/// Converts the image the same way as the export does without the custom conversion
+static bool convertSws(const std::vector<uint8_t> &rgba, int pixFmt, YuvMatrix matrix, bool fullRange, Image &image) {
+    SwsContext *sc = sws_getContext(WIDTH, HEIGHT, AV_PIX_FMT_RGBA, WIDTH, HEIGHT, (AVPixelFormat) pixFmt, SWS_BILINEAR|SWS_ACCURATE_RND, NULL, NULL, NULL);
+    if (!sc)
+        return false;
+    const int *coefficients = sws_getCoefficients(matrix == BT709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+    sws_setColorspaceDetails(sc, coefficients, 1, coefficients, fullRange ? 1 : 0, 0, 1<<16, 1<<16);
+    const uint8_t *invImgData[4] = { &rgba[0]+4*WIDTH*(HEIGHT-1) };
+    int invImgLinesizes[4] = { -4*WIDTH };
+    uint8_t *dst[4] = { &image.planes[0][0], &image.planes[1][0], &image.planes[2][0] };
+    int dstLinesize[4] = { image.linesize[0], image.linesize[1], image.linesize[2] };
+    sws_scale(sc, invImgData, invImgLinesizes, 0, HEIGHT, dst, dstLinesize);
+    sws_freeContext(sc);
+    return true;
+}
+
+static int maxDifference(const Image &a, const Image &b, int plane) {
+    int difference = 0;
+    for (size_t i = 0; i < a.planes[plane].size(); ++i)
+        difference = std::max(difference, abs((int) a.planes[plane][i]-(int) b.planes[plane][i]));
+    return difference;
+}
+
+static const char * simdName(SimdLevel simd) {
+    switch (simd) {
+        case SIMD_SSE2:
+            return "sse2";
+        case SIMD_AVX2:
+            return "avx2";
+        case SIMD_NEON:
+            return "neon";
+        default:
+            return "scalar";
+    }
+}
+
+int main() {
+    std::vector<SimdLevel> levels;
+    SimdLevel detected = detectSimd();
+    if (detected == SIMD_SSE2 || detected == SIMD_AVX2)
+        levels.push_back(SIMD_SSE2);
+    if (detected == SIMD_AVX2 || detected == SIMD_NEON)
+        levels.push_back(detected);
+    std::vector<uint8_t> noise = noiseImage();
+    std::vector<uint8_t> smooth = smoothImage();
+    int failures = 0;
+    const int pixFmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV444P };
+    for (int pixFmt : pixFmts) {
+        for (int matrix = BT601; matrix <= BT709; ++matrix) {
+            for (int fullRange = 0; fullRange <= 1; ++fullRange) {
+                bool subsampled = pixFmt == AV_PIX_FMT_YUV420P;
+                printf("%s %s %s:", subsampled ? "yuv420p" : "yuv444p", matrix == BT709 ? "bt709" : "bt601", fullRange ? "full" : "limited");
+                // The SIMD paths must produce exactly the same result as the scalar code
+                Image scalar = allocateImage(subsampled);
+                convert(SIMD_NONE, noise, pixFmt, (YuvMatrix) matrix, fullRange != 0, scalar);
+                for (SimdLevel simd : levels) {
+                    Image image = allocateImage(subsampled);
+                    bool identical = convert(simd, noise, pixFmt, (YuvMatrix) matrix, fullRange != 0, image) && image.planes[0] == scalar.planes[0] && image.planes[1] == scalar.planes[1] && image.planes[2] == scalar.planes[2];
+                    printf(" %s %s,", simdName(simd), identical ? "identical" : "DIFFERENT");
+                    failures += !identical;
+                }
+                // The scalar code must agree with swscale within rounding
+                Image reference = allocateImage(subsampled);
+                convert(SIMD_NONE, smooth, pixFmt, (YuvMatrix) matrix, fullRange != 0, scalar);
+                if (!convertSws(smooth, pixFmt, (YuvMatrix) matrix, fullRange != 0, reference)) {
+                    printf(" swscale FAILED\n");
+                    ++failures;
+                    continue;
+                }
+                int differences[3] = { maxDifference(scalar, reference, 0), maxDifference(scalar, reference, 1), maxDifference(scalar, reference, 2) };
+                bool close = differences[0] <= LUMA_TOLERANCE && differences[1] <= CHROMA_TOLERANCE && differences[2] <= CHROMA_TOLERANCE;
+                printf(" swscale max difference Y %d U %d V %d%s\n", differences[0], differences[1], differences[2], close ? "" : " TOO LARGE");
+                failures += !close;
+            }
+        }
+    }
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
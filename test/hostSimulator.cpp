@@ -0,0 +1,606 @@
+// Drives the built extension through its C API like Shadron would, and reports throughput, latency percentiles and peak memory of each stage
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+#include <shadron-api.h>
+
+// Host version reported to the extension, which enables expression arguments
+#define HOST_VERSION 141
+// Synthetic video input, long enough for several keyframe intervals
+#define VIDEO_WIDTH 1280
+#define VIDEO_HEIGHT 720
+#define VIDEO_FRAMERATE 30
+#define VIDEO_DURATION 10
+#define VIDEO_GOP_SIZE 30
+// Display rate at which realtime playback is requested
+#define DISPLAY_RATE 60
+#define SEEK_COUNT 100
+#define EXPORT_FRAMERATE 30
+#define EXPORT_DURATION 4
+#define SOUND_SAMPLE_RATE 44100
+#define SOUND_DURATION 60
+#define SOUND_REPETITIONS 3
+// Duration of the uncompressed and lossless sound files whose decoding is limited by reading the input
+#define THROUGHPUT_SOUND_DURATION 600
+// Duration of the sound files decoded with --long, where growing the sample storage would dominate
+#define LONG_SOUND_DURATION 3600
+#define PARSE_COUNT 1000
+// Numbers of registered objects between which the time to look objects up by name should not grow
+#define REGISTRY_SMALL 100
+#define REGISTRY_LARGE 10000
+#define REGISTRY_LOOKUPS 2000
+
+/// Entry points of the loaded extension
+struct Extension {
+    void *library;
+    void *context;
+    int videoFileIndex, mp4Index;
+    decltype(&shadron_register_extension) registerExtension;
+    decltype(&shadron_unregister_extension) unregisterExtension;
+    decltype(&shadron_register_initializer) registerInitializer;
+    decltype(&shadron_parse_initializer) parseInitializer;
+    decltype(&shadron_parse_initializer_argument) parseInitializerArgument;
+    decltype(&shadron_parse_initializer_finish) parseInitializerFinish;
+    decltype(&shadron_object_prepare) objectPrepare;
+    decltype(&shadron_object_offer_source_pixels) objectOfferSourcePixels;
+    decltype(&shadron_object_post_source_pixels) objectPostSourcePixels;
+    decltype(&shadron_object_destroy) objectDestroy;
+    decltype(&shadron_object_fetch_pixels) objectFetchPixels;
+    decltype(&shadron_object_release_pixels) objectReleasePixels;
+    decltype(&shadron_object_start_export) objectStartExport;
+    decltype(&shadron_export_prepare_step) exportPrepareStep;
+    decltype(&shadron_export_step) exportStep;
+    decltype(&shadron_export_finish) exportFinish;
+    decltype(&shadron_decode_sound) decodeSound;
+    decltype(&shadron_decode_fetch_samples) decodeFetchSamples;
+    decltype(&shadron_decode_discard) decodeDiscard;
+};
+
+/// Latencies of the operations of one stage and the number of items (frames, objects, seconds of sound, megabytes of input) they produced
+struct Stage {
+    const char *name;
+    const char *unit;
+    std::vector<double> latencies;
+    double totalTime;
+    long long items;
+    bool failed;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+static double percentile(const std::vector<double> &sorted, int p) {
+    if (sorted.empty())
+        return 0.;
+    return sorted[(sorted.size()-1)*p/100];
+}
+
+/// Peak resident set size of the process in MiB
+static double peakRss() {
+    struct rusage usage = { };
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (double) usage.ru_maxrss/(1024.*1024.);
+#else
+    return (double) usage.ru_maxrss/1024.;
+#endif
+}
+
+static void report(const Stage &stage) {
+    std::vector<double> sorted(stage.latencies);
+    std::sort(sorted.begin(), sorted.end());
+    printf("%-22s %8lld %-7s %10.1f/s %9.3f %9.3f %9.3f %9.3f %9.1f%s\n", stage.name, stage.items, stage.unit, stage.totalTime > 0. ? stage.items/stage.totalTime : 0., 1000.*percentile(sorted, 50), 1000.*percentile(sorted, 90), 1000.*percentile(sorted, 99), sorted.empty() ? 0. : 1000.*sorted.back(), peakRss(), stage.failed ? "  FAILED" : "");
+}
+
+static bool loadExtension(const char *filename, Extension &ext) {
+    if (!(ext.library = dlopen(filename, RTLD_NOW|RTLD_LOCAL))) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    bool ok = true;
+    #define LOAD_ENTRY_POINT(member, name) ok = ok && (ext.member = reinterpret_cast<decltype(ext.member)>(dlsym(ext.library, #name))) != NULL
+    LOAD_ENTRY_POINT(registerExtension, shadron_register_extension);
+    LOAD_ENTRY_POINT(unregisterExtension, shadron_unregister_extension);
+    LOAD_ENTRY_POINT(registerInitializer, shadron_register_initializer);
+    LOAD_ENTRY_POINT(parseInitializer, shadron_parse_initializer);
+    LOAD_ENTRY_POINT(parseInitializerArgument, shadron_parse_initializer_argument);
+    LOAD_ENTRY_POINT(parseInitializerFinish, shadron_parse_initializer_finish);
+    LOAD_ENTRY_POINT(objectPrepare, shadron_object_prepare);
+    LOAD_ENTRY_POINT(objectOfferSourcePixels, shadron_object_offer_source_pixels);
+    LOAD_ENTRY_POINT(objectPostSourcePixels, shadron_object_post_source_pixels);
+    LOAD_ENTRY_POINT(objectDestroy, shadron_object_destroy);
+    LOAD_ENTRY_POINT(objectFetchPixels, shadron_object_fetch_pixels);
+    LOAD_ENTRY_POINT(objectReleasePixels, shadron_object_release_pixels);
+    LOAD_ENTRY_POINT(objectStartExport, shadron_object_start_export);
+    LOAD_ENTRY_POINT(exportPrepareStep, shadron_export_prepare_step);
+    LOAD_ENTRY_POINT(exportStep, shadron_export_step);
+    LOAD_ENTRY_POINT(exportFinish, shadron_export_finish);
+    LOAD_ENTRY_POINT(decodeSound, shadron_decode_sound);
+    LOAD_ENTRY_POINT(decodeFetchSamples, shadron_decode_fetch_samples);
+    LOAD_ENTRY_POINT(decodeDiscard, shadron_decode_discard);
+    #undef LOAD_ENTRY_POINT
+    if (!ok) {
+        fprintf(stderr, "%s is missing entry points of the extension API\n", filename);
+        return false;
+    }
+    int magicNumber = 0, flags = 0, version = HOST_VERSION;
+    char name[64];
+    int nameLength = sizeof(name);
+    if (ext.registerExtension(&magicNumber, &flags, name, &nameLength, &version, &ext.context) != SHADRON_RESULT_OK || magicNumber != SHADRON_MAGICNO)
+        return false;
+    // Initializers are looked up by name, as the host does
+    ext.videoFileIndex = -1, ext.mp4Index = -1;
+    for (int index = 0; ; ++index) {
+        int initializerFlags = 0;
+        nameLength = sizeof(name);
+        if (ext.registerInitializer(ext.context, index, &initializerFlags, name, &nameLength) != SHADRON_RESULT_OK)
+            break;
+        std::string initializer(name, nameLength);
+        if (initializer == "video_file")
+            ext.videoFileIndex = index;
+        else if (initializer == "mp4")
+            ext.mp4Index = index;
+    }
+    return ext.videoFileIndex >= 0 && ext.mp4Index >= 0;
+}
+
+/// Argument of an initializer as passed by the host
+struct Argument {
+    int type;
+    const void *data;
+};
+
+/// Parses an initializer with the arguments and returns the new object, or NULL on error
+static void * parseObject(Extension &ext, int objectType, int index, const char *objectName, const std::vector<Argument> &arguments) {
+    void *parseContext = NULL;
+    int argumentTypes = 0;
+    if (ext.parseInitializer(ext.context, objectType, index, objectName, (int) strlen(objectName), &parseContext, &argumentTypes) != SHADRON_RESULT_OK)
+        return NULL;
+    int result = SHADRON_RESULT_OK;
+    for (int i = 0; i < (int) arguments.size() && result == SHADRON_RESULT_OK; ++i) {
+        if (!(argumentTypes&arguments[i].type))
+            result = SHADRON_RESULT_PARSE_ERROR;
+        else
+            result = ext.parseInitializerArgument(ext.context, parseContext, i, arguments[i].type, arguments[i].data, &argumentTypes);
+    }
+    if (result == SHADRON_RESULT_OK && !(argumentTypes&SHADRON_ARG_NONE))
+        result = SHADRON_RESULT_PARSE_ERROR;
+    void *object = NULL;
+    if (ext.parseInitializerFinish(ext.context, parseContext, result, objectType, objectName, (int) strlen(objectName), &object) != SHADRON_RESULT_OK || result != SHADRON_RESULT_OK)
+        return NULL;
+    return object;
+}
+
+static void * parseVideoFile(Extension &ext, const char *objectName, const char *filename) {
+    std::vector<Argument> arguments;
+    if (filename) {
+        Argument argument = { SHADRON_ARG_FILENAME, filename };
+        arguments.push_back(argument);
+    }
+    return parseObject(ext, SHADRON_FLAG_ANIMATION, ext.videoFileIndex, objectName, arguments);
+}
+
+/// A moving gradient, which the encoders cannot compress to nothing
+static void fillPicture(uint8_t *const planes[], const int linesizes[], int width, int height, int frame) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+            planes[0][y*linesizes[0]+x] = (uint8_t) (x+y+3*frame);
+    }
+    for (int y = 0; y < height/2; ++y) {
+        for (int x = 0; x < width/2; ++x) {
+            planes[1][y*linesizes[1]+x] = (uint8_t) (128+y+frame);
+            planes[2][y*linesizes[2]+x] = (uint8_t) (64+x+5*frame);
+        }
+    }
+}
+
+static void fillRgba(std::vector<uint8_t> &pixels, int width, int height, int frame) {
+    for (int y = 0; y < height; ++y) {
+        uint8_t *row = &pixels[4*width*y];
+        for (int x = 0; x < width; ++x) {
+            row[4*x] = (uint8_t) (x+frame);
+            row[4*x+1] = (uint8_t) (y+2*frame);
+            row[4*x+2] = (uint8_t) (x^y);
+            row[4*x+3] = 255;
+        }
+    }
+}
+
+static bool writePackets(AVFormatContext *fc, AVCodecContext *cc, AVStream *stream, AVPacket *packet) {
+    int result;
+    while ((result = avcodec_receive_packet(cc, packet)) == 0) {
+        av_packet_rescale_ts(packet, cc->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        if (av_interleaved_write_frame(fc, packet) < 0)
+            return false;
+    }
+    return result == AVERROR(EAGAIN) || result == AVERROR_EOF;
+}
+
+/// Encodes duration seconds of synthetic video or sound with the encoder into filename, whose extension selects the container
+static bool encodeMedia(const char *filename, const char *encoderName, int duration) {
+    AVCodec *codec = avcodec_find_encoder_by_name(encoderName);
+    AVFormatContext *fc = NULL;
+    if (!codec || avformat_alloc_output_context2(&fc, NULL, NULL, filename) < 0)
+        return false;
+    bool video = codec->type == AVMEDIA_TYPE_VIDEO;
+    bool ok = false;
+    AVStream *stream = avformat_new_stream(fc, NULL);
+    AVCodecContext *cc = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    if (stream && cc && frame && packet) {
+        if (video) {
+            cc->width = VIDEO_WIDTH;
+            cc->height = VIDEO_HEIGHT;
+            cc->pix_fmt = AV_PIX_FMT_YUV420P;
+            cc->gop_size = VIDEO_GOP_SIZE;
+            cc->bit_rate = 4000000;
+            cc->time_base = av_make_q(1, VIDEO_FRAMERATE);
+            stream->avg_frame_rate = av_make_q(VIDEO_FRAMERATE, 1);
+        } else {
+            cc->sample_rate = SOUND_SAMPLE_RATE;
+            cc->channels = 2;
+            cc->channel_layout = AV_CH_LAYOUT_STEREO;
+            cc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+            cc->bit_rate = 192000;
+            cc->time_base = av_make_q(1, SOUND_SAMPLE_RATE);
+        }
+        if (fc->oformat->flags&AVFMT_GLOBALHEADER)
+            cc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (avcodec_open2(cc, codec, NULL) >= 0 && avcodec_parameters_from_context(stream->codecpar, cc) >= 0 && avio_open(&fc->pb, filename, AVIO_FLAG_WRITE) >= 0) {
+            stream->time_base = cc->time_base;
+            if (video) {
+                frame->format = cc->pix_fmt;
+                frame->width = cc->width;
+                frame->height = cc->height;
+            } else {
+                frame->nb_samples = cc->frame_size > 0 ? cc->frame_size : 1024;
+                frame->format = cc->sample_fmt;
+                frame->channels = cc->channels;
+                frame->channel_layout = cc->channel_layout;
+            }
+            ok = avformat_write_header(fc, NULL) >= 0 && av_frame_get_buffer(frame, 0) >= 0;
+            int end = duration*(video ? VIDEO_FRAMERATE : SOUND_SAMPLE_RATE);
+            for (int position = 0; ok && position < end; position += video ? 1 : frame->nb_samples) {
+                ok = av_frame_make_writable(frame) >= 0;
+                if (ok) {
+                    if (video)
+                        fillPicture(frame->data, frame->linesize, frame->width, frame->height, position);
+                    else {
+                        // A tone in each channel, packed or planar 16-bit, 32-bit or float
+                        bool planar = av_sample_fmt_is_planar((AVSampleFormat) frame->format) != 0;
+                        AVSampleFormat packedFormat = av_get_packed_sample_fmt((AVSampleFormat) frame->format);
+                        for (int i = 0; i < frame->nb_samples; ++i) {
+                            for (int c = 0; c < frame->channels; ++c) {
+                                double value = .4*sin(2.*M_PI*(220.+110.*c)*(position+i)/SOUND_SAMPLE_RATE);
+                                int index = planar ? i : frame->channels*i+c;
+                                uint8_t *plane = frame->extended_data[planar ? c : 0];
+                                if (packedFormat == AV_SAMPLE_FMT_S16)
+                                    reinterpret_cast<int16_t *>(plane)[index] = (int16_t) (32767.*value);
+                                else if (packedFormat == AV_SAMPLE_FMT_S32)
+                                    reinterpret_cast<int32_t *>(plane)[index] = (int32_t) (2147483647.*value);
+                                else if (packedFormat == AV_SAMPLE_FMT_FLT)
+                                    reinterpret_cast<float *>(plane)[index] = (float) value;
+                            }
+                        }
+                    }
+                    frame->pts = position;
+                    ok = avcodec_send_frame(cc, frame) >= 0 && writePackets(fc, cc, stream, packet);
+                }
+            }
+            ok = ok && avcodec_send_frame(cc, NULL) >= 0 && writePackets(fc, cc, stream, packet) && av_write_trailer(fc) >= 0;
+            avio_closep(&fc->pb);
+        }
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&cc);
+    avformat_free_context(fc);
+    return ok;
+}
+
+static bool readFile(const char *filename, std::vector<unsigned char> &data) {
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data.resize(size > 0 ? (size_t) size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, data.size(), file) == data.size();
+    fclose(file);
+    return ok;
+}
+
+/// Creates and destroys video_file objects through the parser
+static Stage benchmarkParsing(Extension &ext, const std::string &videoFilename) {
+    Stage stage = { "parse_initializer", "objects" };
+    std::vector<void *> objects;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < PARSE_COUNT; ++i) {
+        char name[32];
+        sprintf(name, "video%d", i);
+        Clock::time_point opStart = Clock::now();
+        void *object = parseVideoFile(ext, name, videoFilename.c_str());
+        stage.latencies.push_back(elapsed(opStart));
+        if (!object) {
+            stage.failed = true;
+            break;
+        }
+        objects.push_back(object);
+    }
+    stage.totalTime = elapsed(start);
+    stage.items = (long long) objects.size();
+    for (std::vector<void *>::iterator it = objects.begin(); it != objects.end(); ++it)
+        ext.objectDestroy(ext.context, *it);
+    return stage;
+}
+
+/// Parses exports whose framerate and duration refer to one of objectCount registered video_file objects by name, as in projects with many video inputs
+static Stage benchmarkRegistry(Extension &ext, const char *name, int objectCount) {
+    Stage stage = { name, "parses" };
+    std::vector<void *> objects;
+    for (int i = 0; i < objectCount && !stage.failed; ++i) {
+        char objectName[32];
+        sprintf(objectName, "input%d", i);
+        void *object = parseVideoFile(ext, objectName, NULL);
+        if (object)
+            objects.push_back(object);
+        else
+            stage.failed = true;
+    }
+    const int sourceId = 1;
+    const int source[2] = { sourceId, SHADRON_FLAG_ANIMATION };
+    unsigned state = 12345;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < REGISTRY_LOOKUPS && !stage.failed; ++i) {
+        state = state*1103515245u+12345u;
+        char sourceName[32];
+        sprintf(sourceName, "input%d", (int) ((state>>8)%(unsigned) objectCount));
+        std::vector<Argument> arguments;
+        Argument sourceArgument = { SHADRON_ARG_SOURCE_OBJ, source };
+        Argument filenameArgument = { SHADRON_ARG_FILENAME, "unused.mp4" };
+        Argument codecArgument = { SHADRON_ARG_KEYWORD, "h264" };
+        Argument framerateArgument = { SHADRON_ARG_KEYWORD, sourceName };
+        arguments.push_back(sourceArgument);
+        arguments.push_back(filenameArgument);
+        arguments.push_back(codecArgument);
+        arguments.push_back(framerateArgument);
+        Clock::time_point opStart = Clock::now();
+        void *object = parseObject(ext, SHADRON_FLAG_EXPORT, ext.mp4Index, "export", arguments);
+        stage.latencies.push_back(elapsed(opStart));
+        if (object) {
+            ++stage.items;
+            ext.objectDestroy(ext.context, object);
+        } else
+            stage.failed = true;
+    }
+    stage.totalTime = elapsed(start);
+    for (std::vector<void *>::iterator it = objects.begin(); it != objects.end(); ++it)
+        ext.objectDestroy(ext.context, *it);
+    return stage;
+}
+
+/// Requests frames of a video_file as the host does on each display refresh, either in realtime as fast as they are delivered, or at random times as when seeking
+static Stage benchmarkPlayback(Extension &ext, const std::string &videoFilename, bool realTime) {
+    Stage stage = { realTime ? "fetch_pixels play" : "fetch_pixels seek", "frames" };
+    void *object = parseVideoFile(ext, realTime ? "playback" : "seeking", videoFilename.c_str());
+    int flags = SHADRON_FLAG_HARD_RESET, width = 0, height = 0, format = 0;
+    if (!object || ext.objectPrepare(ext.context, object, &flags, &width, &height, &format) != SHADRON_RESULT_OK || width != VIDEO_WIDTH || height != VIDEO_HEIGHT) {
+        stage.failed = true;
+        if (object)
+            ext.objectDestroy(ext.context, object);
+        return stage;
+    }
+    const float deltaTime = 1.f/DISPLAY_RATE;
+    int requests = realTime ? VIDEO_DURATION*DISPLAY_RATE : SEEK_COUNT;
+    unsigned state = 12345;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < requests; ++i) {
+        float time = i*deltaTime;
+        if (!realTime) {
+            state = state*1103515245u+12345u;
+            time = (float) (state>>8)/(float) (1u<<24)*VIDEO_DURATION;
+        }
+        const void *pixels = NULL;
+        void *pixelsContext = NULL;
+        Clock::time_point opStart = Clock::now();
+        int result = ext.objectFetchPixels(ext.context, object, time, deltaTime, realTime, 0, width, height, SHADRON_FORMAT_RGBA_BYTE, &pixels, &pixelsContext);
+        stage.latencies.push_back(elapsed(opStart));
+        if (result == SHADRON_RESULT_OK) {
+            ++stage.items;
+            ext.objectReleasePixels(ext.context, object, pixelsContext);
+        } else if (result != SHADRON_RESULT_NO_CHANGE)
+            stage.failed = true;
+    }
+    stage.totalTime = elapsed(start);
+    ext.objectDestroy(ext.context, object);
+    return stage;
+}
+
+/// Exports a synthetic animation through the mp4 export sequence, the host rendering each frame into a source buffer offered by the extension
+static Stage benchmarkExport(Extension &ext, const std::string &outputFilename) {
+    Stage stage = { "export_step", "frames" };
+    const int sourceId = 1;
+    const int source[2] = { sourceId, SHADRON_FLAG_ANIMATION };
+    const float framerate = EXPORT_FRAMERATE, duration = EXPORT_DURATION;
+    std::vector<Argument> arguments;
+    Argument sourceArgument = { SHADRON_ARG_SOURCE_OBJ, source };
+    Argument filenameArgument = { SHADRON_ARG_FILENAME, outputFilename.c_str() };
+    Argument codecArgument = { SHADRON_ARG_KEYWORD, "h264" };
+    Argument framerateArgument = { SHADRON_ARG_FLOAT, &framerate };
+    Argument durationArgument = { SHADRON_ARG_FLOAT, &duration };
+    arguments.push_back(sourceArgument);
+    arguments.push_back(filenameArgument);
+    arguments.push_back(codecArgument);
+    arguments.push_back(framerateArgument);
+    arguments.push_back(durationArgument);
+    void *object = parseObject(ext, SHADRON_FLAG_EXPORT, ext.mp4Index, "export", arguments);
+    int stepCount = 0;
+    void *exportData = NULL;
+    if (!object || ext.objectStartExport(ext.context, object, &stepCount, &exportData) != SHADRON_RESULT_OK) {
+        stage.failed = true;
+        if (object)
+            ext.objectDestroy(ext.context, object);
+        return stage;
+    }
+    std::vector<uint8_t> frame((size_t) 4*VIDEO_WIDTH*VIDEO_HEIGHT);
+    int result = SHADRON_RESULT_OK;
+    Clock::time_point start = Clock::now();
+    for (int step = 0; step < stepCount && result == SHADRON_RESULT_OK; ++step) {
+        // The frame is rendered outside of the measured time, as the host's rendering is not the extension's cost
+        fillRgba(frame, VIDEO_WIDTH, VIDEO_HEIGHT, step);
+        Clock::time_point opStart = Clock::now();
+        float time = 0.f, deltaTime = 0.f;
+        int filenameLength = 0;
+        if ((result = ext.exportPrepareStep(ext.context, object, exportData, step, &time, &deltaTime, &filenameLength, SHADRON_FLAG_CHARSET_UTF8)) != SHADRON_RESULT_OK)
+            break;
+        void *buffer = NULL, *pixelsContext = NULL;
+        int sourceFormat = 0;
+        if (ext.objectOfferSourcePixels(ext.context, object, sourceId, SHADRON_FLAG_ANIMATION, VIDEO_WIDTH, VIDEO_HEIGHT, &sourceFormat, &buffer, &pixelsContext) == SHADRON_RESULT_OK && buffer)
+            memcpy(buffer, &frame[0], frame.size());
+        else
+            buffer = &frame[0], pixelsContext = NULL;
+        if ((result = ext.objectPostSourcePixels(ext.context, object, pixelsContext, sourceId, 0, VIDEO_WIDTH, VIDEO_HEIGHT, SHADRON_FORMAT_RGBA_BYTE, buffer)) == SHADRON_RESULT_OK)
+            result = ext.exportStep(ext.context, object, exportData, step, time, deltaTime);
+        stage.latencies.push_back(elapsed(opStart));
+        stage.items += result == SHADRON_RESULT_OK;
+    }
+    // Finishing waits for the encoders to flush, which belongs to the export's duration
+    ext.exportFinish(ext.context, object, exportData, result);
+    stage.totalTime = elapsed(start);
+    stage.failed = result != SHADRON_RESULT_OK || stage.items != stepCount;
+    ext.objectDestroy(ext.context, object);
+    return stage;
+}
+
+/// Decodes a whole sound file as the host does when it is loaded. The items are either the decoded duration in seconds, or for throughput, the megabytes of input read.
+static Stage benchmarkSound(Extension &ext, const char *name, const std::vector<unsigned char> &file, int repetitions, bool throughput = false) {
+    Stage stage = { name, throughput ? "MB" : "s" };
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < repetitions && !stage.failed; ++i) {
+        Clock::time_point opStart = Clock::now();
+        int sampleRate = 0, sampleCount = 0, format = SHADRON_FORMAT_STEREO_INT16LE;
+        void *decoderContext = NULL;
+        if (ext.decodeSound(ext.context, &file[0], (int) file.size(), &sampleRate, &sampleCount, &format, &decoderContext) != SHADRON_RESULT_OK || sampleRate <= 0 || sampleCount <= 0) {
+            stage.failed = true;
+            break;
+        }
+        std::vector<int16_t> samples((size_t) 2*sampleCount);
+        stage.failed = ext.decodeFetchSamples(ext.context, decoderContext, &file[0], (int) file.size(), &samples[0], sampleCount, format) != SHADRON_RESULT_OK;
+        stage.latencies.push_back(elapsed(opStart));
+        stage.items += throughput ? (long long) (file.size()>>20) : sampleCount/sampleRate;
+    }
+    stage.totalTime = elapsed(start);
+    return stage;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || (argc > 2 && strcmp(argv[2], "--long"))) {
+        fprintf(stderr, "Usage: %s <extension library> [--long]\n", argv[0]);
+        return 1;
+    }
+    bool longSounds = argc > 2;
+    // The sample cache is disabled by pointing it to a directory that cannot be created, so that each decode really takes place
+    setenv("XDG_CACHE_HOME", "/dev/null", 1);
+    av_log_set_level(AV_LOG_ERROR);
+    char directory[] = "/tmp/hostSimulatorXXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "Failed to create a temporary directory\n");
+        return 1;
+    }
+    std::string videoFilename = std::string(directory)+"/input.mp4";
+    std::string exportFilename = std::string(directory)+"/export.mp4";
+    const char *const soundFiles[][3] = {
+        { "decode_sound wav", "sound.wav", "pcm_s16le" },
+        { "decode_sound flac", "sound.flac", "flac" },
+        { "decode_sound mp2", "sound.mp2", "mp2" }
+    };
+    // Large files where the in-memory input, rather than the codec, limits the speed
+    const char *const throughputSoundFiles[][3] = {
+        { "read_sound wav", "large.wav", "pcm_s16le" },
+        { "read_sound flac", "large.flac", "flac" }
+    };
+    // Hour-long files compare the sample storage of builds by decoding time and peak memory
+    const char *const longSoundFiles[][3] = {
+        { "decode_sound 1h mp3", "long.mp3", "libmp3lame" },
+        { "decode_sound 1h aac", "long.m4a", "aac" },
+        { "decode_sound 1h flac", "long.flac", "flac" }
+    };
+    Extension ext = { };
+    if (!loadExtension(argv[1], ext)) {
+        fprintf(stderr, "Failed to load the extension from %s\n", argv[1]);
+        return 1;
+    }
+    if (!encodeMedia(videoFilename.c_str(), "mpeg4", VIDEO_DURATION)) {
+        fprintf(stderr, "Failed to generate the video input\n");
+        return 1;
+    }
+    std::vector<Stage> stages;
+    stages.push_back(benchmarkParsing(ext, videoFilename));
+    stages.push_back(benchmarkRegistry(ext, "find in 100", REGISTRY_SMALL));
+    stages.push_back(benchmarkRegistry(ext, "find in 10000", REGISTRY_LARGE));
+    stages.push_back(benchmarkPlayback(ext, videoFilename, true));
+    stages.push_back(benchmarkPlayback(ext, videoFilename, false));
+    stages.push_back(benchmarkExport(ext, exportFilename));
+    for (const auto &entry : soundFiles) {
+        std::string filename = std::string(directory)+"/"+entry[1];
+        std::vector<unsigned char> file;
+        if (encodeMedia(filename.c_str(), entry[2], SOUND_DURATION) && readFile(filename.c_str(), file))
+            stages.push_back(benchmarkSound(ext, entry[0], file, SOUND_REPETITIONS));
+        else
+            printf("%s: encoder not available, skipped\n", entry[0]);
+        remove(filename.c_str());
+    }
+    for (const auto &entry : throughputSoundFiles) {
+        std::string filename = std::string(directory)+"/"+entry[1];
+        std::vector<unsigned char> file;
+        if (encodeMedia(filename.c_str(), entry[2], THROUGHPUT_SOUND_DURATION) && readFile(filename.c_str(), file))
+            stages.push_back(benchmarkSound(ext, entry[0], file, SOUND_REPETITIONS, true));
+        else
+            printf("%s: encoder not available, skipped\n", entry[0]);
+        remove(filename.c_str());
+    }
+    // Peak memory only grows, so these come last
+    for (int i = 0; longSounds && i < (int) (sizeof(longSoundFiles)/sizeof(*longSoundFiles)); ++i) {
+        std::string filename = std::string(directory)+"/"+longSoundFiles[i][1];
+        std::vector<unsigned char> file;
+        if (encodeMedia(filename.c_str(), longSoundFiles[i][2], LONG_SOUND_DURATION) && readFile(filename.c_str(), file))
+            stages.push_back(benchmarkSound(ext, longSoundFiles[i][0], file, 1));
+        else
+            printf("%s: encoder not available, skipped\n", longSoundFiles[i][0]);
+        remove(filename.c_str());
+    }
+    printf("%-22s %8s %-7s %12s %9s %9s %9s %9s %9s\n", "stage", "items", "", "rate", "p50 ms", "p90 ms", "p99 ms", "max ms", "RSS MiB");
+    int failures = 0;
+    for (std::vector<Stage>::const_iterator it = stages.begin(); it != stages.end(); ++it) {
+        report(*it);
+        failures += it->failed;
+    }
+    ext.unregisterExtension(ext.context);
+    remove(videoFilename.c_str());
+    remove(exportFilename.c_str());
+    rmdir(directory);
+    if (failures) {
+        printf("%d stages failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
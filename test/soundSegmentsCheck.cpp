@@ -0,0 +1,204 @@
+// Compares sound files decoded serially and in parallel segments, which must be identical down to the last sample
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+#include "../src/SoundDecoder.h"
+#include "../src/WorkerPool.h"
+
+#define SAMPLE_RATE 44100
+// Long enough for several segments of at least MIN_SEGMENT_SAMPLES
+#define DURATION 40
+#define SEGMENT_THREADS 4
+#define IO_BUFFER_SIZE 0x1000
+
+/// Encoded file built in memory by the muxer
+struct OutputFile {
+    std::vector<unsigned char> data;
+    size_t pos;
+
+    static int write(void *opaque, uint8_t *buffer, int size) {
+        OutputFile *file = reinterpret_cast<OutputFile *>(opaque);
+        if (file->pos+size > file->data.size())
+            file->data.resize(file->pos+size);
+        memcpy(&file->data[file->pos], buffer, size);
+        file->pos += size;
+        return size;
+    }
+    static int64_t seek(void *opaque, int64_t offset, int whence) {
+        OutputFile *file = reinterpret_cast<OutputFile *>(opaque);
+        if (whence&AVSEEK_SIZE)
+            return file->data.size();
+        switch (whence&~AVSEEK_FORCE) {
+            case SEEK_SET:
+                file->pos = (size_t) offset;
+                break;
+            case SEEK_CUR:
+                file->pos += (size_t) offset;
+                break;
+            case SEEK_END:
+                file->pos = file->data.size()+(size_t) offset;
+                break;
+            default:
+                return -1;
+        }
+        return file->pos;
+    }
+};
+
+/// A sweeping tone in each channel with a little noise, so that the bit reservoir of MPEG audio is actually used
+static double signal(int channel, int sample) {
+    static unsigned state = 12345;
+    state = state*1103515245u+12345u;
+    double t = (double) sample/SAMPLE_RATE;
+    return .4*sin(2.*M_PI*(220.+40.*t+110.*channel)*t)+.05*((double) (state>>16)/32768.-1.);
+}
+
+static void fillFrame(AVFrame *frame, int firstSample) {
+    bool planar = av_sample_fmt_is_planar((AVSampleFormat) frame->format) != 0;
+    for (int i = 0; i < frame->nb_samples; ++i) {
+        for (int c = 0; c < frame->channels; ++c) {
+            double value = signal(c, firstSample+i);
+            int index = planar ? i : frame->channels*i+c;
+            uint8_t *plane = frame->extended_data[planar ? c : 0];
+            switch (av_get_packed_sample_fmt((AVSampleFormat) frame->format)) {
+                case AV_SAMPLE_FMT_S16:
+                    reinterpret_cast<int16_t *>(plane)[index] = (int16_t) (32767.*value);
+                    break;
+                case AV_SAMPLE_FMT_S32:
+                    reinterpret_cast<int32_t *>(plane)[index] = (int32_t) (2147483647.*value);
+                    break;
+                case AV_SAMPLE_FMT_FLT:
+                    reinterpret_cast<float *>(plane)[index] = (float) value;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+static bool writePackets(AVFormatContext *fc, AVCodecContext *cc, AVStream *stream, AVPacket *packet) {
+    int result;
+    while ((result = avcodec_receive_packet(cc, packet)) == 0) {
+        av_packet_rescale_ts(packet, cc->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        if (av_interleaved_write_frame(fc, packet) < 0)
+            return false;
+    }
+    return result == AVERROR(EAGAIN) || result == AVERROR_EOF;
+}
+
+/// Encodes the test signal into a file of the container format with the encoder. Returns false if the encoder is not available.
+static bool encode(const char *formatName, const char *encoderName, std::vector<unsigned char> &output) {
+    AVCodec *codec = avcodec_find_encoder_by_name(encoderName);
+    AVFormatContext *fc = NULL;
+    if (!codec || avformat_alloc_output_context2(&fc, NULL, formatName, NULL) < 0)
+        return false;
+    OutputFile file;
+    file.pos = 0;
+    bool ok = false;
+    AVStream *stream = avformat_new_stream(fc, NULL);
+    AVCodecContext *cc = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    if (stream && cc && frame && packet) {
+        cc->sample_rate = SAMPLE_RATE;
+        cc->channels = 2;
+        cc->channel_layout = AV_CH_LAYOUT_STEREO;
+        cc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+        cc->bit_rate = 192000;
+        cc->time_base = av_make_q(1, SAMPLE_RATE);
+        if (fc->oformat->flags&AVFMT_GLOBALHEADER)
+            cc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        void *buffer = av_malloc(IO_BUFFER_SIZE);
+        if (buffer && avcodec_open2(cc, codec, NULL) >= 0 && avcodec_parameters_from_context(stream->codecpar, cc) >= 0 && (fc->pb = avio_alloc_context(reinterpret_cast<unsigned char *>(buffer), IO_BUFFER_SIZE, 1, &file, NULL, &OutputFile::write, &OutputFile::seek))) {
+            stream->time_base = cc->time_base;
+            frame->nb_samples = cc->frame_size > 0 ? cc->frame_size : 1024;
+            frame->format = cc->sample_fmt;
+            frame->channels = cc->channels;
+            frame->channel_layout = cc->channel_layout;
+            ok = avformat_write_header(fc, NULL) >= 0 && av_frame_get_buffer(frame, 0) >= 0;
+            for (int position = 0; ok && position < DURATION*SAMPLE_RATE; position += frame->nb_samples) {
+                ok = av_frame_make_writable(frame) >= 0;
+                if (ok) {
+                    fillFrame(frame, position);
+                    frame->pts = position;
+                    ok = avcodec_send_frame(cc, frame) >= 0 && writePackets(fc, cc, stream, packet);
+                }
+            }
+            ok = ok && avcodec_send_frame(cc, NULL) >= 0 && writePackets(fc, cc, stream, packet) && av_write_trailer(fc) >= 0;
+            avio_flush(fc->pb);
+            av_freep(&fc->pb->buffer);
+            avio_context_free(&fc->pb);
+        } else
+            av_free(buffer);
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&cc);
+    avformat_free_context(fc);
+    if (ok)
+        output.swap(file.data);
+    return ok;
+}
+
+static bool decode(const std::vector<unsigned char> &file, WorkerPool *workers, std::vector<unsigned char> &samples) {
+    SoundDecoder *decoder = SoundDecoder::decode(&file[0], (int) file.size(), SoundDecoder::Format(), workers);
+    if (!decoder)
+        return false;
+    samples.resize((size_t) decoder->getFormat().sampleSize()*decoder->getSampleCount());
+    bool ok = samples.empty() || decoder->fetchWaveform(&file[0], (int) file.size(), &samples[0], decoder->getSampleCount(), workers);
+    delete decoder;
+    return ok;
+}
+
+int main() {
+    // The sample cache is disabled by pointing it to a directory that cannot be created, so that both decodes really take place
+    setenv("XDG_CACHE_HOME", "/dev/null", 1);
+    const char *const files[][2] = {
+        { "wav", "pcm_s16le" },
+        { "flac", "flac" },
+        { "mp2", "mp2" },
+        // The MPEG audio layer III segments also depend on the pre-roll to refill the bit reservoir
+        { "mp3", "libmp3lame" }
+    };
+    WorkerPool workers(SEGMENT_THREADS);
+    int failures = 0;
+    for (const auto &entry : files) {
+        printf("%s (%s):", entry[0], entry[1]);
+        std::vector<unsigned char> file;
+        if (!encode(entry[0], entry[1], file)) {
+            printf(" encoder not available, skipped\n");
+            continue;
+        }
+        std::vector<unsigned char> serial, segmented;
+        if (!decode(file, NULL, serial) || !decode(file, &workers, segmented)) {
+            printf(" decoding FAILED\n");
+            ++failures;
+            continue;
+        }
+        size_t sampleSize = SoundDecoder::Format().sampleSize();
+        size_t mismatch = 0;
+        while (mismatch < serial.size() && mismatch < segmented.size() && serial[mismatch] == segmented[mismatch])
+            ++mismatch;
+        bool identical = serial.size() == segmented.size() && mismatch == serial.size();
+        if (identical)
+            printf(" %d samples identical\n", (int) (serial.size()/sampleSize));
+        else
+            printf(" DIFFERENT, %d serial and %d segmented samples, first difference at sample %d\n", (int) (serial.size()/sampleSize), (int) (segmented.size()/sampleSize), (int) (mismatch/sampleSize));
+        failures += !identical;
+    }
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}